@@ -3,14 +3,21 @@
 #include <unistd.h> // For lseek, close, R_OK, ftruncate
 #include <fcntl.h>  // For O_RDONLY etc, R_OK is actually in unistd.h
 
+#include <inttypes.h>
+#include <map>
+
 #include <libfdt.h>
-#include <mincrypt/sha.h>
-#include <mincrypt/sha256.h>
+#include <xxhash.h>
+#include <lz4.h>
+#include <lz4hc.h>
 #include <base.hpp>
 
 #include "bootimg.hpp"
 #include "magiskboot.hpp"
 #include "compress.hpp"
+#include "cpio.hpp"
+#include "hash.hpp"
+#include "scan.hpp"
 
 #ifndef SVB_WIN32
   // On POSIX systems like macOS and Linux with modern settings,
@@ -33,33 +40,203 @@ static void decompress(format_t type, int fd, const void *in, size_t size) {
     ptr->write(in, size, true);
 }
 
-static off_t compress(format_t type, int fd, const void *in, size_t size) {
-    auto prev = lseek(fd, 0, SEEK_CUR);
+// A component decompressed by unpack. As long as the decompressed file is left
+// untouched, repack copies the original compressed block instead of compressing again.
+struct manifest_entry {
+    format_t fmt = UNKNOWN;
+    size_t offset = 0;
+    size_t size = 0;
+    // Hash of the compressed block, checked before it is copied
+    uint64_t comp_hash = 0;
+    size_t raw_sz = 0;
+    uint64_t hash = 0;
+};
+
+using manifest_t = map<string, manifest_entry, less<>>;
+
+// Passes data through, recording its size and hash when done
+class xxh_stream : public filter_stream {
+public:
+    xxh_stream(stream_ptr &&base, manifest_entry &e) :
+        filter_stream(std::move(base)), e(e), state(XXH64_createState()) {
+        XXH64_reset(state, 0);
+        e.raw_sz = 0;
+    }
+
+    ~xxh_stream() override {
+        e.hash = XXH64_digest(state);
+        XXH64_freeState(state);
+    }
+
+    bool write(const void *buf, size_t len) override {
+        XXH64_update(state, buf, len);
+        e.raw_sz += len;
+        return filter_stream::write(buf, len);
+    }
+
+private:
+    manifest_entry &e;
+    XXH64_state_t *state;
+};
+
+#define LZ4_LEGACY_MAGIC "\x02\x21\x4c\x18"
+
+// An lz4 legacy stream is a magic followed by independently compressed blocks, each one
+// LZ4_UNCOMPRESSED bytes once decompressed except for the last. Record every block, so
+// repack only has to compress again the ones that changed.
+static void record_lz4_blocks(FILE *manifest, const boot_img &boot, const char *file,
+                              const uint8_t *in, size_t size) {
+    vector<manifest_entry> blocks;
+    auto out = make_unique<char[]>(LZ4_UNCOMPRESSED);
+    size_t pos = 4;
+    while (pos + 4 <= size) {
+        uint32_t block_sz;
+        memcpy(&block_sz, in + pos, sizeof(block_sz));
+        // Concatenated streams, or blocks of any other size, are not worth handling
+        if (block_sz > size - pos - 4 || (!blocks.empty() && blocks.back().raw_sz != LZ4_UNCOMPRESSED))
+            return;
+        int r = LZ4_decompress_safe((const char *) in + pos + 4, out.get(), block_sz, LZ4_UNCOMPRESSED);
+        if (r < 0)
+            return;
+        blocks.push_back({ LZ4_LEGACY, (size_t) (in + pos - boot.map.buf), block_sz + 4,
+                           XXH64(in + pos, block_sz + 4, 0), (size_t) r, XXH64(out.get(), r, 0) });
+        pos += block_sz + 4;
+    }
+    if (pos != size)
+        return;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        auto &e = blocks[i];
+        fprintf(manifest, "%s#%zu %s %zu %zu %016" PRIx64 " %zu %016" PRIx64 "\n",
+                file, i, fmt2name[e.fmt], e.offset, e.size, e.comp_hash, e.raw_sz, e.hash);
+    }
+}
+
+static void decompress(FILE *manifest, const boot_img &boot, const char *file,
+                       format_t type, const uint8_t *in, size_t size) {
+    manifest_entry e { type, (size_t) (in - boot.map.buf), size, XXH64(in, size, 0) };
+    int fd = creat(file, 0644);
     {
-        auto strm = get_encoder(type, make_unique<fd_stream>(fd));
-        strm->write(in, size, true);
+        auto ptr = get_decoder(type, make_unique<xxh_stream>(make_unique<fd_stream>(fd), e));
+        ptr->write(in, size, true);
+    }
+    close(fd);
+    fprintf(manifest, "%s %s %zu %zu %016" PRIx64 " %zu %016" PRIx64 "\n",
+            file, fmt2name[e.fmt], e.offset, e.size, e.comp_hash, e.raw_sz, e.hash);
+    if (type == LZ4_LEGACY)
+        record_lz4_blocks(manifest, boot, file, in, size);
+}
+
+static manifest_t load_manifest() {
+    manifest_t manifest;
+    FILE *fp = fopen(MANIFEST_FILE, "re");
+    if (fp == nullptr)
+        return manifest;
+    char file[64], fmt[16];
+    manifest_entry e;
+    while (fscanf(fp, "%63s %15s %zu %zu %" SCNx64 " %zu %" SCNx64 "\n",
+                  file, fmt, &e.offset, &e.size, &e.comp_hash, &e.raw_sz, &e.hash) == 7) {
+        e.fmt = name2fmt[fmt];
+        manifest.emplace(file, e);
+    }
+    fclose(fp);
+    return manifest;
+}
+
+// Whether the manifest entry of file was recorded from this compressed block
+static const manifest_entry *find_source(const manifest_t &manifest, const boot_img &boot,
+                                         const char *file, format_t fmt, const uint8_t *block, size_t size) {
+    auto it = manifest.find(file);
+    if (it == manifest.end())
+        return nullptr;
+    auto &e = it->second;
+    if (e.fmt != fmt || e.offset != (size_t) (block - boot.map.buf) || e.size != size ||
+        e.comp_hash != XXH64(block, size, 0))
+        return nullptr;
+    return &e;
+}
+
+// Whether the compressed block can be copied as is for file, whose content is m
+static bool reusable(const manifest_t &manifest, const boot_img &boot, const char *file,
+                     format_t fmt, const uint8_t *block, size_t size, const mmap_data &m, FILE *log) {
+    auto e = find_source(manifest, boot, file, fmt, block, size);
+    if (e == nullptr || e->raw_sz != m.sz || e->hash != XXH64(m.buf, m.sz, 0))
+        return false;
+    fprintf(log, "%-*s [%s]\n", PADDING, "REUSE", file);
+    return true;
+}
+
+// Compress the ramdisk as lz4 legacy, copying the blocks whose content did not change
+// from the original image. Returns false if there is nothing to reuse or compression fails.
+static bool compress_lz4_blocks(const manifest_t &manifest, const boot_img &boot, const mmap_data &m,
+                                uint8_t *&buf, size_t &sz, FILE *log) {
+    if (!find_source(manifest, boot, RAMDISK_FILE, LZ4_LEGACY, boot.ramdisk, boot.hdr->ramdisk_size()))
+        return false;
+    vector<const manifest_entry *> blocks;
+    for (;;) {
+        auto it = manifest.find(RAMDISK_FILE "#"s + to_string(blocks.size()));
+        if (it == manifest.end() || it->second.offset + it->second.size > boot.map.sz)
+            break;
+        blocks.push_back(&it->second);
+    }
+
+    size_t num = (m.sz + LZ4_UNCOMPRESSED - 1) / LZ4_UNCOMPRESSED;
+    vector<bool> clean(num);
+    size_t reused = 0;
+    for (size_t i = 0; i < num && i < blocks.size(); ++i) {
+        size_t len = std::min(LZ4_UNCOMPRESSED, m.sz - i * LZ4_UNCOMPRESSED);
+        clean[i] = blocks[i]->raw_sz == len &&
+                   blocks[i]->hash == XXH64(m.buf + i * LZ4_UNCOMPRESSED, len, 0) &&
+                   blocks[i]->comp_hash == XXH64(boot.map.buf + blocks[i]->offset, blocks[i]->size, 0);
+        reused += clean[i];
     }
-    auto now = lseek(fd, 0, SEEK_CUR);
-    return now - prev;
+    if (reused == 0)
+        return false;
+    fprintf(log, "%-*s [%s] [%zu/%zu blocks]\n", PADDING, "REUSE", RAMDISK_FILE, reused, num);
+
+    // Same layout as the lz4 legacy encoder
+    const size_t bound = LZ4_COMPRESSBOUND(LZ4_UNCOMPRESSED);
+    auto out = make_unique<char[]>(bound);
+    byte_stream strm(buf, sz);
+    strm.write(LZ4_LEGACY_MAGIC, 4);
+    for (size_t i = 0; i < num; ++i) {
+        if (clean[i]) {
+            strm.write(boot.map.buf + blocks[i]->offset, blocks[i]->size);
+            continue;
+        }
+        auto in = reinterpret_cast<const char *>(m.buf + i * LZ4_UNCOMPRESSED);
+        int len = std::min(LZ4_UNCOMPRESSED, m.sz - i * LZ4_UNCOMPRESSED);
+        uint32_t block_sz = LZ4_compress_HC(in, out.get(), len, bound, LZ4HC_CLEVEL_MAX);
+        if (block_sz == 0) {
+            LOGW("LZ4HC compression failure\n");
+            free(buf);
+            buf = nullptr;
+            sz = 0;
+            return false;
+        }
+        strm.write(&block_sz, sizeof(block_sz));
+        strm.write(out.get(), block_sz);
+    }
+    return true;
 }
 
-static void dump(const void *buf, size_t size, const char *filename) {
+static void compress(format_t type, const void *in, size_t size, uint8_t *&buf, size_t &sz) {
+    auto strm = get_encoder(type, make_unique<byte_stream>(buf, sz));
+    strm->write(in, size, true);
+}
+
+// When buf is mapped from src_fd at src_off, the data is copied within the kernel
+static void dump(const void *buf, size_t size, const char *filename, int src_fd = -1, off_t src_off = 0) {
     if (size == 0)
         return;
     int fd = creat(filename, 0644);
-    xwrite(fd, buf, size);
+    size_t done = src_fd < 0 ? 0 : copy_range(src_fd, src_off, fd, 0, size);
+    if (done < size) {
+        lseek(fd, done, SEEK_SET);
+        xwrite(fd, static_cast<const uint8_t *>(buf) + done, size - done);
+    }
     close(fd);
 }
 
-static size_t restore(int fd, const char *filename) {
-    int ifd = xopen(filename, O_RDONLY);
-    size_t size = lseek(ifd, 0, SEEK_END);
-    lseek(ifd, 0, SEEK_SET);
-    xsendfile(fd, ifd, nullptr, size);
-    close(ifd);
-    return size;
-}
-
 void dyn_img_hdr::print() {
     uint32_t ver = header_version();
     fprintf(stderr, "%-*s [%u]\n", PADDING, "HEADER_VER", ver);
@@ -159,33 +336,37 @@ void dyn_img_hdr::load_hdr_file() {
     });
 }
 
+// Magics of the boot image header and of the wrappers preceding it
+static const magic_scanner hdr_scanner {
+    MAGIC(CHROMEOS_MAGIC), MAGIC(BOOT_MAGIC), MAGIC(VENDOR_BOOT_MAGIC),
+    MAGIC(DHTB_MAGIC), MAGIC(TEGRABLOB_MAGIC) };
+static const format_t hdr_formats[] = { CHROMEOS, AOSP, AOSP_VENDOR, DHTB, BLOB_FMT };
+
 boot_img::boot_img(const char *image) : map(image) {
     fprintf(stderr, "Parsing image: [%s]\n", image);
-    for (const uint8_t *addr = map.buf; addr < map.buf + map.sz; ++addr) {
-        format_t fmt = check_fmt(addr, map.sz);
+    int idx;
+    for (size_t off = 0; (off = hdr_scanner.find(map.buf, map.sz, off, &idx)) < map.sz;) {
+        format_t fmt = hdr_formats[idx];
         switch (fmt) {
         case CHROMEOS:
             // chromeos require external signing
             flags[CHROMEOS_FLAG] = true;
-            addr += 65535;
+            off += 65536;
             break;
         case DHTB:
             flags[DHTB_FLAG] = true;
             flags[SEANDROID_FLAG] = true;
             fprintf(stderr, "DHTB_HDR\n");
-            addr += sizeof(dhtb_hdr) - 1;
+            off += sizeof(dhtb_hdr);
             break;
         case BLOB_FMT:
             flags[BLOB_FLAG] = true;
             fprintf(stderr, "TEGRA_BLOB\n");
-            addr += sizeof(blob_hdr) - 1;
+            off += sizeof(blob_hdr);
             break;
-        case AOSP:
-        case AOSP_VENDOR:
-            parse_image(addr, fmt);
-            return;
         default:
-            break;
+            parse_image(map.buf + off, fmt);
+            return;
         }
     }
     exit(1);
@@ -196,13 +377,11 @@ boot_img::~boot_img() {
 }
 
 static int find_dtb_offset(const uint8_t *buf, unsigned sz) {
+    static const magic_scanner scanner { MAGIC(DTB_MAGIC) };
     const uint8_t * const end = buf + sz;
 
-    for (auto curr = buf; curr < end; curr += sizeof(fdt_header)) {
-        curr = static_cast<uint8_t*>(memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt32_t)));
-        if (curr == nullptr)
-            return -1;
-
+    for (size_t off = 0; (off = scanner.find(buf, sz, off)) < sz; off += sizeof(fdt_header)) {
+        auto curr = buf + off;
         auto fdt_hdr = reinterpret_cast<const fdt_header *>(curr);
 
         // Check that fdt_header.totalsize does not overflow kernel image size
@@ -330,17 +509,20 @@ if (hdr->name##_size()) {                                           \
     off += blk_sz;                                                  \
 }
 
-void boot_img::parse_image(const uint8_t *addr, format_t type) {
-    hdr = create_hdr(addr, type);
-
-    if (char *id = hdr->id()) {
+// Whether the boot id is a SHA256 digest rather than a SHA1 one
+static bool sha256_id(const char *id) {
+    if (id) {
         for (int i = SHA_DIGEST_SIZE + 4; i < SHA256_DIGEST_SIZE; ++i) {
-            if (id[i]) {
-                flags[SHA256_FLAG] = true;
-                break;
-            }
+            if (id[i])
+                return true;
         }
     }
+    return false;
+}
+
+void boot_img::parse_image(const uint8_t *addr, format_t type) {
+    hdr = create_hdr(addr, type);
+    flags[SHA256_FLAG] = sha256_id(hdr->id());
 
     hdr->print();
 
@@ -475,7 +657,9 @@ int split_image_dtb(const char *filename) {
         } else {
             dump(img.buf, off, KERNEL_FILE);
         }
-        dump(img.buf + off, img.sz - off, KER_DTB_FILE);
+        int fd = xopen(filename, O_RDONLY | O_CLOEXEC);
+        dump(img.buf + off, img.sz - off, KER_DTB_FILE, fd, off);
+        close(fd);
         return 0;
     } else {
         fprintf(stderr, "Cannot find DTB in %s\n", filename);
@@ -489,61 +673,471 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
     if (hdr)
         boot.hdr->dump_hdr_file();
 
-    // Dump kernel
-    if (!skip_decomp && COMPRESSED(boot.k_fmt)) {
-        if (boot.hdr->kernel_size() != 0) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(boot.k_fmt, fd, boot.kernel, boot.hdr->kernel_size());
-            close(fd);
+    // Raw components are copied from the image file within the kernel
+    int img_fd = xopen(image, O_RDONLY | O_CLOEXEC);
+
+    // Every component comes from its own range of the read-only image, so they are all
+    // extracted at once. Manifest records are buffered per component to keep their order.
+    vector<function<void(FILE *)>> jobs;
+    auto component = [&](const char *file, format_t fmt, const uint8_t *buf, size_t size) {
+        if (!skip_decomp && COMPRESSED(fmt)) {
+            if (size != 0)
+                jobs.emplace_back([=, &boot](FILE *fp) { decompress(fp, boot, file, fmt, buf, size); });
+        } else {
+            off_t off = buf - boot.map.buf;
+            jobs.emplace_back([=](FILE *) { dump(buf, size, file, img_fd, off); });
         }
-    } else {
-        dump(boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
+    };
+    component(KERNEL_FILE, boot.k_fmt, boot.kernel, boot.hdr->kernel_size());
+    component(KER_DTB_FILE, UNKNOWN, boot.kernel_dtb, boot.hdr->kernel_dt_size);
+    component(RAMDISK_FILE, boot.r_fmt, boot.ramdisk, boot.hdr->ramdisk_size());
+    component(SECOND_FILE, UNKNOWN, boot.second, boot.hdr->second_size());
+    component(EXTRA_FILE, boot.e_fmt, boot.extra, boot.hdr->extra_size());
+    component(RECV_DTBO_FILE, UNKNOWN, boot.recovery_dtbo, boot.hdr->recovery_dtbo_size());
+    component(DTB_FILE, UNKNOWN, boot.dtb, boot.hdr->dtb_size());
+
+    // A job that cannot buffer its records runs afterwards, writing them to the manifest
+    vector<string> records(jobs.size());
+    vector<char> deferred(jobs.size());
+    parallel_for(jobs.size(), [&](size_t i) {
+        mem_log rec;
+        if (!rec.buffered()) {
+            deferred[i] = true;
+            return;
+        }
+        jobs[i](rec.fp());
+        records[i] = rec.take();
+    });
+
+    unlink(MANIFEST_FILE);
+    FILE *manifest = skip_decomp ? nullptr : xfopen(MANIFEST_FILE, "we");
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (deferred[i])
+            jobs[i](manifest);
+        else if (manifest)
+            fwrite(records[i].data(), 1, records[i].size(), manifest);
     }
+    if (manifest)
+        fclose(manifest);
+    close(img_fd);
 
-    // Dump kernel_dtb
-    dump(boot.kernel_dtb, boot.hdr->kernel_dt_size, KER_DTB_FILE);
+    return boot.flags[CHROMEOS_FLAG] ? 2 : 0;
+}
 
-    // Dump ramdisk
-    if (!skip_decomp && COMPRESSED(boot.r_fmt)) {
-        if (boot.hdr->ramdisk_size() != 0) {
-            int fd = creat(RAMDISK_FILE, 0644);
-            decompress(boot.r_fmt, fd, boot.ramdisk, boot.hdr->ramdisk_size());
-            close(fd);
+// Read len bytes at off, past the end of the image reads as zeros
+static void read_at(int fd, uint64_t off, void *buf, size_t len) {
+    auto p = static_cast<uint8_t *>(buf);
+    while (len) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    memset(p, 0, len);
+}
+
+// Same as check_fmt_lg, only reading the block headers of lz4_legacy
+static format_t check_fmt_at(int fd, uint64_t off, uint32_t size) {
+    uint8_t head[64];
+    read_at(fd, off, head, sizeof(head));
+    format_t fmt = check_fmt(head, std::min<size_t>(size, sizeof(head)));
+    if (fmt == LZ4_LEGACY) {
+        uint64_t pos = 4;
+        uint32_t block_sz;
+        while (pos + sizeof(block_sz) <= size) {
+            read_at(fd, off + pos, &block_sz, sizeof(block_sz));
+            pos += sizeof(block_sz);
+            if (pos + block_sz > size)
+                return LZ4_LG;
+            pos += block_sz;
         }
-    } else {
-        dump(boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
     }
+    return fmt;
+}
 
-    // Dump second
-    dump(boot.second, boot.hdr->second_size(), SECOND_FILE);
+static void json_chars(const char *s, size_t max) {
+    for (size_t i = 0; s && i < max && s[i]; ++i) {
+        auto c = static_cast<unsigned char>(s[i]);
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+}
 
-    // Dump extra
-    if (!skip_decomp && COMPRESSED(boot.e_fmt)) {
-        if (boot.hdr->extra_size() != 0) {
-            int fd = creat(EXTRA_FILE, 0644);
-            decompress(boot.e_fmt, fd, boot.extra, boot.hdr->extra_size());
-            close(fd);
+int info(const char *image) {
+    int fd = xopen(image, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 1;
+    // Also the size of block devices
+    uint64_t img_sz = lseek64(fd, 0, SEEK_END);
+    boot_img boot;
+
+    // Find the header the same way boot_img does, a chunk at a time. Chunks overlap by
+    // more than the longest magic, so that magics cut at the end of one are found.
+    constexpr size_t chunk = 1 << 20;
+    constexpr size_t overlap = 32;
+    vector<uint8_t> buf(chunk);
+    uint64_t hdr_off = 0;
+    format_t fmt = UNKNOWN;
+    for (uint64_t pos = 0; fmt == UNKNOWN;) {
+        size_t len = pos < img_sz ? std::min<uint64_t>(chunk, img_sz - pos) : 0;
+        read_at(fd, pos, buf.data(), len);
+        int idx;
+        size_t at = hdr_scanner.find(buf.data(), len, 0, &idx);
+        if (at == len) {
+            if (pos + len >= img_sz) {
+                fprintf(stderr, "Cannot find boot image header in %s\n", image);
+                close(fd);
+                return 1;
+            }
+            pos += len - overlap;
+            continue;
+        }
+        pos += at;
+        switch (hdr_formats[idx]) {
+        case CHROMEOS:
+            boot.flags[CHROMEOS_FLAG] = true;
+            pos += 65536;
+            break;
+        case DHTB:
+            boot.flags[DHTB_FLAG] = true;
+            boot.flags[SEANDROID_FLAG] = true;
+            pos += sizeof(dhtb_hdr);
+            break;
+        case BLOB_FMT:
+            boot.flags[BLOB_FLAG] = true;
+            pos += sizeof(blob_hdr);
+            break;
+        default:
+            hdr_off = pos;
+            fmt = hdr_formats[idx];
+            break;
         }
-    } else {
-        dump(boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
     }
 
-    // Dump recovery_dtbo
-    dump(boot.recovery_dtbo, boot.hdr->recovery_dtbo_size(), RECV_DTBO_FILE);
+    // The header can be moved by a pre-header, so the buffer is laid out as the image
+    // and only the pages where a header can be are read
+    constexpr size_t page = 16384;
+    vector<uint8_t> head(NOOKHD_PRE_HEADER_SZ + page);
+    for (size_t shift : { 0, ACCLAIM_PRE_HEADER_SZ, NOOKHD_PRE_HEADER_SZ })
+        read_at(fd, hdr_off + shift, head.data() + shift, page);
+    auto hdr = boot.hdr = boot.create_hdr(head.data(), fmt);
+    boot.flags[SHA256_FLAG] = sha256_id(hdr->id());
+    uint64_t base = hdr_off + (boot.hdr_addr - head.data());
+
+    // Components, as laid out by the header
+    struct part {
+        const char *name;
+        uint64_t off;
+        uint32_t size;
+        // Only detected for kernel, ramdisk and extra
+        format_t fmt;
+        bool typed;
+    };
+    vector<part> parts;
+    uint64_t off = base + hdr->hdr_space();
+    auto block = [&](const char *name, uint32_t size) -> part * {
+        uint64_t at = off;
+        off = base + align_to(off - base + size, hdr->page_size());
+        if (size == 0)
+            return nullptr;
+        parts.push_back({ name, at, size, UNKNOWN, false });
+        return &parts.back();
+    };
+    auto detect = [&](part *p) {
+        p->fmt = check_fmt_at(fd, p->off, p->size);
+        p->typed = true;
+    };
+    // Skip the MTK header of a component
+    auto mtk = [&](part *p, int flag) {
+        if (p->fmt != MTK)
+            return;
+        boot.flags[flag] = true;
+        p->off += sizeof(mtk_hdr);
+        p->size -= std::min<uint32_t>(p->size, sizeof(mtk_hdr));
+        p->fmt = check_fmt_at(fd, p->off, p->size);
+    };
 
-    // Dump dtb
-    dump(boot.dtb, boot.hdr->dtb_size(), DTB_FILE);
+    parts.reserve(9);
+    if (auto p = block("kernel", hdr->kernel_size())) {
+        detect(p);
+        mtk(p, MTK_KERNEL);
+        if (p->fmt == ZIMAGE) {
+            // The gzip piggy starts within the decompressor, and the table of
+            // offsets at the end of the zImage holds where it ends
+            vector<uint8_t> z(65536);
+            read_at(fd, p->off, z.data(), z.size());
+            auto z_hdr = reinterpret_cast<const zimage_hdr *>(z.data());
+            auto gz = static_cast<const uint8_t *>(
+                    memmem(z.data(), std::min<size_t>(p->size, z.size()), GZIP1_MAGIC "\x08\x00", 4));
+            uint32_t zImage_size = z_hdr->end - z_hdr->start;
+            if (gz && zImage_size >= 0xFF && zImage_size <= p->size) {
+                uint32_t hdr_sz = gz - z.data();
+                uint32_t offsets[16];
+                read_at(fd, p->off + zImage_size - sizeof(offsets), offsets, sizeof(offsets));
+                for (int i = 15; i >= 0; --i) {
+                    if (offsets[i] > (zImage_size - 0xFF) && offsets[i] < zImage_size &&
+                        offsets[i] > hdr_sz) {
+                        boot.flags[ZIMAGE_KERNEL] = true;
+                        p->off += hdr_sz;
+                        p->size = offsets[i] - hdr_sz;
+                        p->fmt = check_fmt_at(fd, p->off, p->size);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    if (auto p = block("ramdisk", hdr->ramdisk_size())) {
+        // v4 vendor boot contains multiple ramdisks, left as raw
+        p->typed = true;
+        if (!hdr->is_vendor || hdr->header_version() < 4) {
+            detect(p);
+            mtk(p, MTK_RAMDISK);
+        }
+    }
+    block("second", hdr->second_size());
+    if (auto p = block("extra", hdr->extra_size()))
+        detect(p);
+    block("recovery_dtbo", hdr->recovery_dtbo_size());
+    block("dtb", hdr->dtb_size());
+    block("signature", hdr->signature_size());
+    block("vendor_ramdisk_table", hdr->vendor_ramdisk_table_size());
+    block("bootconfig", hdr->bootconfig_size());
+
+    // Special magics right after the image, and the AVB footer at the very end
+    AvbFooter footer{};
+    uint64_t vbmeta_off = 0;
+    if (off < img_sz) {
+        char magic[16];
+        read_at(fd, off, magic, sizeof(magic));
+        if (img_sz - off >= 16 && BUFFER_MATCH(magic, SEANDROID_MAGIC))
+            boot.flags[SEANDROID_FLAG] = true;
+        else if (img_sz - off >= 16 && BUFFER_MATCH(magic, LG_BUMP_MAGIC))
+            boot.flags[LG_BUMP_FLAG] = true;
+
+        if (img_sz - off >= sizeof(footer)) {
+            read_at(fd, img_sz - sizeof(footer), &footer, sizeof(footer));
+            if (BUFFER_MATCH(footer.magic, AVB_FOOTER_MAGIC)) {
+                vbmeta_off = base + __builtin_bswap64(footer.vbmeta_offset);
+                read_at(fd, vbmeta_off, magic, AVB_MAGIC_LEN);
+                boot.flags[AVB_FLAG] = BUFFER_MATCH(magic, AVB_MAGIC);
+            }
+        }
+    }
+    close(fd);
 
-    return boot.flags[CHROMEOS_FLAG] ? 2 : 0;
+    static const char *flag_names[] = {
+        "mtk_kernel", "mtk_ramdisk", "chromeos", "dhtb", "seandroid", "lg_bump", "sha256",
+        "blob", "nookhd", "acclaim", "amonet", "avb", "zimage_kernel" };
+    static_assert(std::size(flag_names) == BOOT_FLAGS_MAX);
+
+    printf("{\n");
+    printf("  \"image_size\": %" PRIu64 ",\n", img_sz);
+    printf("  \"format\": \"%s\",\n", fmt == AOSP_VENDOR ? "aosp_vendor" : "aosp");
+    printf("  \"header_offset\": %" PRIu64 ",\n", base);
+    printf("  \"header_version\": %u,\n", hdr->header_version());
+    printf("  \"page_size\": %u,\n", hdr->page_size());
+    if (uint32_t os_ver = hdr->os_version()) {
+        int version = os_ver >> 11;
+        int patch_level = os_ver & 0x7ff;
+        printf("  \"os_version\": \"%d.%d.%d\",\n",
+               (version >> 14) & 0x7f, (version >> 7) & 0x7f, version & 0x7f);
+        printf("  \"os_patch_level\": \"%d-%02d\",\n", (patch_level >> 4) + 2000, patch_level & 0xf);
+    }
+    if (char *name = hdr->name()) {
+        printf("  \"name\": \"");
+        json_chars(name, BOOT_NAME_SIZE);
+        printf("\",\n");
+    }
+    printf("  \"cmdline\": \"");
+    json_chars(hdr->cmdline(), BOOT_ARGS_SIZE);
+    json_chars(hdr->extra_cmdline(), BOOT_EXTRA_ARGS_SIZE);
+    printf("\",\n");
+    if (char *id = hdr->id()) {
+        printf("  \"id\": \"");
+        int len = boot.flags[SHA256_FLAG] ? SHA256_DIGEST_SIZE : SHA_DIGEST_SIZE;
+        for (int i = 0; i < len; ++i)
+            printf("%02hhx", id[i]);
+        printf("\",\n");
+    }
+    printf("  \"flags\": [");
+    for (int i = 0, n = 0; i < BOOT_FLAGS_MAX; ++i) {
+        if (boot.flags[i])
+            printf("%s\"%s\"", n++ ? ", " : "", flag_names[i]);
+    }
+    printf("],\n");
+    printf("  \"components\": {");
+    for (size_t i = 0; i < parts.size(); ++i) {
+        auto &p = parts[i];
+        printf("%s\n    \"%s\": { \"offset\": %" PRIu64 ", \"size\": %u",
+               i ? "," : "", p.name, p.off, p.size);
+        if (p.typed)
+            printf(", \"format\": \"%s\"", fmt2name[p.fmt]);
+        printf(" }");
+    }
+    printf("\n  }");
+    if (boot.flags[AVB_FLAG]) {
+        printf(",\n  \"avb\": { \"original_image_size\": %" PRIu64 ", \"vbmeta_offset\": %" PRIu64
+               ", \"vbmeta_size\": %" PRIu64 " }",
+               (uint64_t) __builtin_bswap64(footer.original_image_size), vbmeta_off,
+               (uint64_t) __builtin_bswap64(footer.vbmeta_size));
+    }
+    printf("\n}\n");
+    return 0;
 }
 
 #define file_align_with(page_size) \
-write_zero(fd, align_padding(lseek(fd, 0, SEEK_CUR) - off.header, page_size))
+pos += align_padding(pos - off.header, page_size)
 
 #define file_align() file_align_with(boot.hdr->page_size())
 
+static void decode(format_t fmt, const void *in1, size_t len1, const void *in2, size_t len2,
+                   uint8_t *&buf, size_t &sz) {
+    auto strm = get_decoder(fmt, make_unique<byte_stream>(buf, sz));
+    strm->write(in1, len1);
+    if (len2)
+        strm->write(in2, len2);
+}
+
+static bool is_cpio(const void *buf, size_t sz) {
+    return sz >= 6 && memcmp(buf, "070701", 6) == 0;
+}
+
+// Append the entries that changed as a new compressed cpio segment, reusing the original
+// compressed ramdisk verbatim. The kernel and load_cpio both apply concatenated archives
+// in order, later entries replacing earlier ones. Returns false if it cannot be done.
+static bool overlay_ramdisk(const boot_img &boot, format_t fmt, const mmap_data &m,
+                            uint8_t *&buf, size_t &sz, FILE *log) {
+    // Only formats our own decoders read back when concatenated
+    if (fmt != boot.r_fmt || (fmt != GZIP && fmt != LZ4 && fmt != LZ4_LEGACY))
+        return false;
+    auto orig = boot.ramdisk;
+    size_t orig_sz = boot.hdr->ramdisk_size();
+
+    uint8_t *base_buf = nullptr, *delta_buf = nullptr, *check_buf = nullptr;
+    size_t base_sz = 0, delta_sz = 0, check_sz = 0;
+    bool ok = false;
+    decode(fmt, orig, orig_sz, nullptr, 0, base_buf, base_sz);
+    {
+        cpio base, cur;
+        cur.load_cpio(reinterpret_cast<const char *>(m.buf), m.sz);
+        if (is_cpio(base_buf, base_sz)) {
+            base.load_cpio(reinterpret_cast<char *>(base_buf), base_sz);
+            auto strm = get_encoder(fmt, make_unique<byte_stream>(delta_buf, delta_sz));
+            ok = cur.dump_overlay(base, *strm, log);
+        }
+        if (ok) {
+            // Make sure the result reads back as the new ramdisk
+            decode(fmt, orig, orig_sz, delta_buf, delta_sz, check_buf, check_sz);
+            cpio check;
+            check.load_cpio(reinterpret_cast<char *>(check_buf), check_sz);
+            ok = check.equals(cur);
+        }
+    }
+    if (ok) {
+        fprintf(log, "RAMDISK_OVERLAY [%zu] -> [%zu]\n", orig_sz, orig_sz + delta_sz);
+        byte_stream strm(buf, sz);
+        strm.write(orig, orig_sz);
+        strm.write(delta_buf, delta_sz);
+    }
+    free(base_buf);
+    free(delta_buf);
+    free(check_buf);
+    return ok;
+}
+
+// A component file and the content to write for it, either the file itself,
+// the original block in the source image or a newly encoded buffer
+struct packed {
+    bool exists = false;
+    int fd = -1;
+    mmap_data m;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    uint8_t *buf = nullptr;
+    size_t len = 0;
+    bool reuse = false;
+    string log;
+
+    ~packed() {
+        free(buf);
+        if (fd >= 0)
+            close(fd);
+    }
+    void load(const char *file) {
+        if ((exists = access(file, R_OK) == 0)) {
+            fd = xopen(file, O_RDONLY | O_CLOEXEC);
+            m = mmap_data(file);
+            raw(m.buf, m.sz);
+        }
+    }
+    void raw(const uint8_t *d, size_t sz) { data = d; size = sz; }
+    void encoded() { raw(buf, len); }
+};
+
+// Hash over regions of an image, fed while the image is written front to back. Regions
+// are hashed in the order they are added, each optionally followed by its 32-bit size.
+class region_hash {
+public:
+    explicit region_hash(bool sha256) { hash_init(&ctx, sha256); }
+
+    void add(size_t off, uint32_t size, bool with_size = true) {
+        // Nothing to read for an empty region, keep it in place in the sequence
+        if (size == 0)
+            off = regions.empty() ? 0 : regions.back().off + regions.back().size;
+        regions.push_back({ off, size, with_size });
+    }
+
+    // Whether the regions follow each other in the image, so that they can be fed
+    // window by window. Otherwise the whole image has to be fed at once.
+    bool ordered() const {
+        for (size_t i = 1; i < regions.size(); ++i) {
+            if (regions[i].off < regions[i - 1].off + regions[i - 1].size)
+                return false;
+        }
+        return true;
+    }
+
+    // Feed the window [begin, end) of the image, following the previous window.
+    // data holds the content of the window.
+    void feed(const uint8_t *data, size_t begin, size_t end) {
+        for (; next < regions.size(); ++next) {
+            auto &r = regions[next];
+            size_t from = std::max(r.off, begin);
+            size_t to = std::min(r.off + r.size, end);
+            if (from < to)
+                HASH_update(&ctx, data + (from - begin), to - from);
+            if (r.off + r.size > end)
+                break;
+            if (r.with_size)
+                HASH_update(&ctx, &r.size, sizeof(r.size));
+        }
+    }
+
+    const uint8_t *final() { return HASH_final(&ctx); }
+
+private:
+    struct region {
+        size_t off;
+        uint32_t size;
+        bool with_size;
+    };
+    HASH_CTX ctx;
+    vector<region> regions;
+    size_t next = 0;
+};
+
 void repack(const char *src_img, const char *out_img, bool skip_comp) {
     const boot_img boot(src_img);
+    auto manifest = load_manifest();
     fprintf(stderr, "Repack to image: [%s]\n", out_img);
 
     struct {
@@ -568,153 +1162,249 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     if (access(HEADER_FILE, R_OK) == 0)
         hdr->load_hdr_file();
 
-    /***************
-     * Write blocks
-     ***************/
+    /*******************
+     * Encode components
+     *******************/
+
+    // Compression does not depend on the layout, so the components are encoded in memory
+    // concurrently and written in order below. Messages are buffered per component.
+    packed kernel, kernel_dtb, ramdisk, second, extra, recovery_dtbo, dtb;
+    kernel.load(KERNEL_FILE);
+    kernel_dtb.load(KER_DTB_FILE);
+    ramdisk.load(RAMDISK_FILE);
+    second.load(SECOND_FILE);
+    extra.load(EXTRA_FILE);
+    recovery_dtbo.load(RECV_DTBO_FILE);
+    dtb.load(DTB_FILE);
+
+    auto encode_kernel = [&](FILE *log) {
+        auto &m = kernel.m;
+        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(boot.k_fmt)) {
+            kernel.reuse = reusable(manifest, boot, KERNEL_FILE, boot.k_fmt,
+                                    boot.kernel, boot.hdr->kernel_size(), m, log);
+            if (kernel.reuse) {
+                kernel.raw(boot.kernel, boot.hdr->kernel_size());
+            } else {
+                // Always use zopfli for zImage compression
+                auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == GZIP) ? ZOPFLI : boot.k_fmt;
+                compress(fmt, m.buf, m.sz, kernel.buf, kernel.len);
+                kernel.encoded();
+            }
+        }
+    };
+
+    auto encode_ramdisk = [&](FILE *log) {
+        auto &m = ramdisk.m;
+        auto r_fmt = boot.r_fmt;
+        if (!skip_comp && !hdr->is_vendor && hdr->header_version() == 4 && r_fmt != LZ4_LEGACY) {
+            // A v4 boot image ramdisk will have to be merged with other vendor ramdisks,
+            // and they have to use the exact same compression method. v4 GKIs are required to
+            // use lz4 (legacy), so hardcode the format here.
+            fprintf(log, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name[r_fmt], fmt2name[LZ4_LEGACY]);
+            r_fmt = LZ4_LEGACY;
+        }
+        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(r_fmt)) {
+            if (r_fmt == boot.r_fmt && reusable(manifest, boot, RAMDISK_FILE, r_fmt,
+                                                boot.ramdisk, boot.hdr->ramdisk_size(), m, log)) {
+                ramdisk.raw(boot.ramdisk, boot.hdr->ramdisk_size());
+            } else if ((check_env("RAMDISKOVERLAY") && is_cpio(m.buf, m.sz) &&
+                        overlay_ramdisk(boot, r_fmt, m, ramdisk.buf, ramdisk.len, log)) ||
+                       (r_fmt == LZ4_LEGACY && boot.r_fmt == LZ4_LEGACY &&
+                        compress_lz4_blocks(manifest, boot, m, ramdisk.buf, ramdisk.len, log))) {
+                ramdisk.encoded();
+            } else {
+                compress(r_fmt, m.buf, m.sz, ramdisk.buf, ramdisk.len);
+                ramdisk.encoded();
+            }
+        }
+    };
 
-    // Create new image
-    int fd = creat(out_img, 0644);
+    auto encode_extra = [&](FILE *log) {
+        auto &m = extra.m;
+        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(boot.e_fmt)) {
+            if (reusable(manifest, boot, EXTRA_FILE, boot.e_fmt, boot.extra, boot.hdr->extra_size(), m, log)) {
+                extra.raw(boot.extra, boot.hdr->extra_size());
+            } else {
+                compress(boot.e_fmt, m.buf, m.sz, extra.buf, extra.len);
+                extra.encoded();
+            }
+        }
+    };
+
+    vector<pair<packed *, function<void(FILE *)>>> jobs;
+    if (kernel.exists)
+        jobs.emplace_back(&kernel, encode_kernel);
+    if (ramdisk.exists)
+        jobs.emplace_back(&ramdisk, encode_ramdisk);
+    if (extra.exists)
+        jobs.emplace_back(&extra, encode_extra);
+    parallel_for(jobs.size(), [&](size_t i) {
+        mem_log log;
+        jobs[i].second(log.fp());
+        jobs[i].first->log = log.take();
+    });
+    for (auto &job : jobs)
+        fwrite(job.first->log.data(), 1, job.first->log.size(), stderr);
+
+    /**************
+     * Plan layout
+     **************/
+
+    // Every block is placed before anything is written. The image is then created at its
+    // final size, zero filled, and the blocks are copied in place through a single mapping.
+    // Blocks coming straight from a file are copied within the kernel beforehand.
+    struct block {
+        size_t off;
+        const void *data;
+        size_t size;
+        // File the data is mapped from, and its offset there
+        int fd;
+        off_t src;
+        // Leading bytes already copied within the kernel
+        size_t copied;
+    };
+    int img_fd = xopen(src_img, O_RDONLY | O_CLOEXEC);
+    vector<pair<const mmap_data *, int>> sources { { &boot.map, img_fd } };
+    for (auto p : { &kernel, &kernel_dtb, &ramdisk, &second, &extra, &recovery_dtbo, &dtb }) {
+        if (p->exists)
+            sources.emplace_back(&p->m, p->fd);
+    }
+    vector<block> blocks;
+    size_t pos = 0;
+    auto put = [&](const void *data, size_t size) -> size_t {
+        block blk { pos, data, size, -1, 0, 0 };
+        auto p = static_cast<const uint8_t *>(data);
+        for (auto [m, fd] : sources) {
+            if (p >= m->buf && p + size <= m->buf + m->sz) {
+                blk.fd = fd;
+                blk.src = p - m->buf;
+                break;
+            }
+        }
+        blocks.push_back(blk);
+        pos += size;
+        return size;
+    };
 
     if (boot.flags[DHTB_FLAG]) {
         // Skip DHTB header
-        write_zero(fd, sizeof(dhtb_hdr));
+        pos += sizeof(dhtb_hdr);
     } else if (boot.flags[BLOB_FLAG]) {
-        xwrite(fd, boot.map.buf, sizeof(blob_hdr));
+        put(boot.map.buf, sizeof(blob_hdr));
     } else if (boot.flags[NOOKHD_FLAG]) {
-        xwrite(fd, boot.map.buf, NOOKHD_PRE_HEADER_SZ);
+        put(boot.map.buf, NOOKHD_PRE_HEADER_SZ);
     } else if (boot.flags[ACCLAIM_FLAG]) {
-        xwrite(fd, boot.map.buf, ACCLAIM_PRE_HEADER_SZ);
+        put(boot.map.buf, ACCLAIM_PRE_HEADER_SZ);
     }
 
-    // Copy raw header
-    off.header = lseek(fd, 0, SEEK_CUR);
-    xwrite(fd, boot.hdr_addr, hdr->hdr_space());
+    // Copy raw header, the new one is patched in before writing
+    off.header = pos;
+    vector<uint8_t> hdr_page(boot.hdr_addr, boot.hdr_addr + hdr->hdr_space());
+    put(hdr_page.data(), hdr_page.size());
 
     // kernel
-    off.kernel = lseek(fd, 0, SEEK_CUR);
+    off.kernel = pos;
+    mtk_hdr k_hdr, r_hdr;
     if (boot.flags[MTK_KERNEL]) {
         // Copy MTK headers
-        xwrite(fd, boot.k_hdr, sizeof(mtk_hdr));
+        k_hdr = *boot.k_hdr;
+        put(&k_hdr, sizeof(mtk_hdr));
     }
     if (boot.flags[ZIMAGE_KERNEL]) {
         // Copy zImage headers
-        xwrite(fd, boot.z_hdr, boot.z_info.hdr_sz);
+        put(boot.z_hdr, boot.z_info.hdr_sz);
     }
-    if (access(KERNEL_FILE, R_OK) == 0) {
-        auto m = mmap_data(KERNEL_FILE);
-        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(boot.k_fmt)) {
-            // Always use zopfli for zImage compression
-            auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == GZIP) ? ZOPFLI : boot.k_fmt;
-            hdr->kernel_size() = compress(fmt, fd, m.buf, m.sz);
-        } else {
-            hdr->kernel_size() = xwrite(fd, m.buf, m.sz);
+    uint32_t vmlinux_sz = kernel.m.sz;
+    if (kernel.exists) {
+        if (boot.flags[ZIMAGE_KERNEL] && kernel.size > boot.hdr->kernel_size()) {
+            fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
+            kernel.raw(boot.kernel, boot.hdr->kernel_size());
+            kernel.reuse = true;
         }
+        hdr->kernel_size() = put(kernel.data, kernel.size);
 
         if (boot.flags[ZIMAGE_KERNEL]) {
-            if (hdr->kernel_size() > boot.hdr->kernel_size()) {
-                fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
-                ftruncate64(fd, lseek64(fd, - (off64_t) hdr->kernel_size(), SEEK_CUR));
-                xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-            } else if (!skip_comp) {
+            if (!skip_comp && !kernel.reuse) {
                 // Pad zeros to make sure the zImage file size does not change
                 // Also ensure the last 4 bytes are the uncompressed vmlinux size
-                uint32_t sz = m.sz;
-                write_zero(fd, boot.hdr->kernel_size() - hdr->kernel_size() - sizeof(sz));
-                xwrite(fd, &sz, sizeof(sz));
+                pos += boot.hdr->kernel_size() - hdr->kernel_size() - sizeof(vmlinux_sz);
+                put(&vmlinux_sz, sizeof(vmlinux_sz));
             }
 
             // zImage size shall remain the same
             hdr->kernel_size() = boot.hdr->kernel_size();
         }
     } else if (boot.hdr->kernel_size() != 0) {
-        xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-        hdr->kernel_size() = boot.hdr->kernel_size();
+        hdr->kernel_size() = put(boot.kernel, boot.hdr->kernel_size());
     }
     if (boot.flags[ZIMAGE_KERNEL]) {
         // Copy zImage tail and adjust size accordingly
         hdr->kernel_size() += boot.z_info.hdr_sz;
-        hdr->kernel_size() += xwrite(fd, boot.z_info.tail, boot.z_info.tail_sz);
+        hdr->kernel_size() += put(boot.z_info.tail, boot.z_info.tail_sz);
     }
 
     // kernel dtb
-    if (access(KER_DTB_FILE, R_OK) == 0)
-        hdr->kernel_size() += restore(fd, KER_DTB_FILE);
+    if (kernel_dtb.exists)
+        hdr->kernel_size() += put(kernel_dtb.data, kernel_dtb.size);
     file_align();
 
     // ramdisk
-    off.ramdisk = lseek(fd, 0, SEEK_CUR);
+    off.ramdisk = pos;
     if (boot.flags[MTK_RAMDISK]) {
         // Copy MTK headers
-        xwrite(fd, boot.r_hdr, sizeof(mtk_hdr));
+        r_hdr = *boot.r_hdr;
+        put(&r_hdr, sizeof(mtk_hdr));
     }
-    if (access(RAMDISK_FILE, R_OK) == 0) {
-        auto m = mmap_data(RAMDISK_FILE);
-        auto r_fmt = boot.r_fmt;
-        if (!skip_comp && !hdr->is_vendor && hdr->header_version() == 4 && r_fmt != LZ4_LEGACY) {
-            // A v4 boot image ramdisk will have to be merged with other vendor ramdisks,
-            // and they have to use the exact same compression method. v4 GKIs are required to
-            // use lz4 (legacy), so hardcode the format here.
-            fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name[r_fmt], fmt2name[LZ4_LEGACY]);
-            r_fmt = LZ4_LEGACY;
-        }
-        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(r_fmt)) {
-            hdr->ramdisk_size() = compress(r_fmt, fd, m.buf, m.sz);
-        } else {
-            hdr->ramdisk_size() = xwrite(fd, m.buf, m.sz);
-        }
+    if (ramdisk.exists) {
+        hdr->ramdisk_size() = put(ramdisk.data, ramdisk.size);
         file_align();
     }
 
     // second
-    off.second = lseek(fd, 0, SEEK_CUR);
-    if (access(SECOND_FILE, R_OK) == 0) {
-        hdr->second_size() = restore(fd, SECOND_FILE);
+    off.second = pos;
+    if (second.exists) {
+        hdr->second_size() = put(second.data, second.size);
         file_align();
     }
 
     // extra
-    off.extra = lseek(fd, 0, SEEK_CUR);
-    if (access(EXTRA_FILE, R_OK) == 0) {
-        auto m = mmap_data(EXTRA_FILE);
-        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(boot.e_fmt)) {
-            hdr->extra_size() = compress(boot.e_fmt, fd, m.buf, m.sz);
-        } else {
-            hdr->extra_size() = xwrite(fd, m.buf, m.sz);
-        }
+    off.extra = pos;
+    if (extra.exists) {
+        hdr->extra_size() = put(extra.data, extra.size);
         file_align();
     }
 
     // recovery_dtbo
-    if (access(RECV_DTBO_FILE, R_OK) == 0) {
-        hdr->recovery_dtbo_offset() = lseek(fd, 0, SEEK_CUR);
-        hdr->recovery_dtbo_size() = restore(fd, RECV_DTBO_FILE);
+    if (recovery_dtbo.exists) {
+        hdr->recovery_dtbo_offset() = pos;
+        hdr->recovery_dtbo_size() = put(recovery_dtbo.data, recovery_dtbo.size);
         file_align();
     }
 
     // dtb
-    off.dtb = lseek(fd, 0, SEEK_CUR);
-    if (access(DTB_FILE, R_OK) == 0) {
-        hdr->dtb_size() = restore(fd, DTB_FILE);
+    off.dtb = pos;
+    if (dtb.exists) {
+        hdr->dtb_size() = put(dtb.data, dtb.size);
         file_align();
     }
 
     // Directly copy ignored blobs
     if (boot.ignore_size) {
         // ignore_size should already be aligned
-        xwrite(fd, boot.ignore, boot.ignore_size);
+        put(boot.ignore, boot.ignore_size);
     }
 
     // Proprietary stuffs
     if (boot.flags[SEANDROID_FLAG]) {
-        xwrite(fd, SEANDROID_MAGIC, 16);
+        put(SEANDROID_MAGIC, 16);
         if (boot.flags[DHTB_FLAG]) {
-            xwrite(fd, "\xFF\xFF\xFF\xFF", 4);
+            put("\xFF\xFF\xFF\xFF", 4);
         }
     } else if (boot.flags[LG_BUMP_FLAG]) {
-        xwrite(fd, LG_BUMP_MAGIC, 16);
+        put(LG_BUMP_MAGIC, 16);
     }
 
-    off.total = lseek(fd, 0, SEEK_CUR);
+    off.total = pos;
     file_align();
 
     // vbmeta
@@ -722,86 +1412,153 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         // According to avbtool.py, if the input is not an Android sparse image
         // (which boot images are not), the default block size is 4096
         file_align_with(4096);
-        off.vbmeta = lseek(fd, 0, SEEK_CUR);
+        off.vbmeta = pos;
         uint64_t vbmeta_size = __builtin_bswap64(boot.avb_footer->vbmeta_size);
-        xwrite(fd, boot.vbmeta, vbmeta_size);
+        put(boot.vbmeta, vbmeta_size);
     }
 
     // Pad image to original size if not chromeos (as it requires post processing)
     if (!boot.flags[CHROMEOS_FLAG]) {
-        off_t current = lseek(fd, 0, SEEK_CUR);
-        if (current < boot.map.sz) {
-            write_zero(fd, boot.map.sz - current);
-        }
+        pos = std::max(pos, boot.map.sz);
     }
 
-    close(fd);
-
     /******************
-     * Patch the image
+     * Patch the header
      ******************/
 
-    // Map output image as rw
-    auto out = mmap_data(out_img, true);
-
     // MTK headers
     if (boot.flags[MTK_KERNEL]) {
-        auto m_hdr = reinterpret_cast<mtk_hdr *>(out.buf + off.kernel);
-        m_hdr->size = hdr->kernel_size();
+        k_hdr.size = hdr->kernel_size();
         hdr->kernel_size() += sizeof(mtk_hdr);
     }
     if (boot.flags[MTK_RAMDISK]) {
-        auto m_hdr = reinterpret_cast<mtk_hdr *>(out.buf + off.ramdisk);
-        m_hdr->size = hdr->ramdisk_size();
+        r_hdr.size = hdr->ramdisk_size();
         hdr->ramdisk_size() += sizeof(mtk_hdr);
     }
 
     // Make sure header size matches
     hdr->header_size() = hdr->hdr_size();
 
-    // Update checksum
-    if (char *id = hdr->id()) {
-        HASH_CTX ctx;
-        boot.flags[SHA256_FLAG] ? SHA256_init(&ctx) : SHA_init(&ctx);
-        uint32_t size = hdr->kernel_size();
-        HASH_update(&ctx, out.buf + off.kernel, size);
-        HASH_update(&ctx, &size, sizeof(size));
-        size = hdr->ramdisk_size();
-        HASH_update(&ctx, out.buf + off.ramdisk, size);
-        HASH_update(&ctx, &size, sizeof(size));
-        size = hdr->second_size();
-        HASH_update(&ctx, out.buf + off.second, size);
-        HASH_update(&ctx, &size, sizeof(size));
-        size = hdr->extra_size();
-        if (size) {
-            HASH_update(&ctx, out.buf + off.extra, size);
-            HASH_update(&ctx, &size, sizeof(size));
+    auto copy_hdr = [&](uint8_t *dst) {
+        if (boot.flags[AMONET_FLAG]) {
+            auto real_hdr_sz = std::min(hdr->hdr_space() - AMONET_MICROLOADER_SZ, hdr->hdr_size());
+            memcpy(dst + AMONET_MICROLOADER_SZ, hdr->raw_hdr(), real_hdr_sz);
+        } else {
+            memcpy(dst, hdr->raw_hdr(), hdr->hdr_size());
         }
+    };
+    copy_hdr(hdr_page.data());
+
+    // Boot id, over the components and their sizes
+    char *id = hdr->id();
+    region_hash id_hash(boot.flags[SHA256_FLAG]);
+    if (id) {
+        id_hash.add(off.kernel, hdr->kernel_size());
+        id_hash.add(off.ramdisk, hdr->ramdisk_size());
+        id_hash.add(off.second, hdr->second_size());
+        if (hdr->extra_size())
+            id_hash.add(off.extra, hdr->extra_size());
         uint32_t ver = hdr->header_version();
-        if (ver == 1 || ver == 2) {
-            size = hdr->recovery_dtbo_size();
-            HASH_update(&ctx, out.buf + hdr->recovery_dtbo_offset(), size);
-            HASH_update(&ctx, &size, sizeof(size));
+        if (ver == 1 || ver == 2)
+            id_hash.add(hdr->recovery_dtbo_offset(), hdr->recovery_dtbo_size());
+        if (ver == 2)
+            id_hash.add(off.dtb, hdr->dtb_size());
+    }
+
+    // DHTB checksum, over everything up to the end of the boot image including the
+    // header, which can only be final before writing if it does not carry an id
+    region_hash dhtb_hash(true);
+    if (boot.flags[DHTB_FLAG])
+        dhtb_hash.add(sizeof(dhtb_hdr), off.total - sizeof(dhtb_hdr), false);
+    bool fused_id = id && id_hash.ordered();
+    bool fused_dhtb = boot.flags[DHTB_FLAG] && !id;
+
+    /******************
+     * Write blocks
+     ******************/
+
+    // Create new image, ftruncate leaves the padding as zeros
+    int fd = xopen(out_img, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    struct stat st;
+    fstat(fd, &st);
+    if (S_ISREG(st.st_mode)) {
+        if (ftruncate64(fd, pos) < 0)
+            PLOGE("ftruncate %s", out_img);
+    } else {
+        // A block device keeps its size and old content, zero everything between blocks
+        size_t end = 0;
+        for (auto &b : blocks) {
+            lseek64(fd, end, SEEK_SET);
+            write_zero(fd, b.off - end);
+            end = b.off + b.size;
         }
-        if (ver == 2) {
-            size = hdr->dtb_size();
-            HASH_update(&ctx, out.buf + off.dtb, size);
-            HASH_update(&ctx, &size, sizeof(size));
+        lseek64(fd, end, SEEK_SET);
+        write_zero(fd, pos - end);
+    }
+
+    // Let the kernel copy, or share with reflinks, the large blocks of existing files.
+    // Small ones are cheaper to copy through the mapping.
+    for (auto &blk : blocks) {
+        if (blk.fd >= 0 && blk.size >= (1 << 16))
+            blk.copied = copy_range(blk.fd, blk.src, fd, blk.off, blk.size);
+    }
+    close(fd);
+    close(img_fd);
+
+    // Map output image as rw
+    auto out = mmap_data(out_img, true);
+
+    // Copy blocks window by window, and hash each window right after it is written
+    // while it is still in cache, instead of reading the whole image again. Parts
+    // copied by the kernel are hashed from their source, which is already in memory.
+    auto hash = [&](const uint8_t *data, size_t begin, size_t end) {
+        if (fused_id)
+            id_hash.feed(data, begin, end);
+        if (fused_dhtb)
+            dhtb_hash.feed(data, begin, end);
+    };
+    constexpr size_t window = 1 << 20;
+    size_t b = 0;
+    for (size_t begin = 0; begin < pos; begin += window) {
+        size_t end = std::min(pos, begin + window);
+        size_t fed = begin;
+        for (; b < blocks.size() && blocks[b].off < end; ++b) {
+            auto &blk = blocks[b];
+            auto data = static_cast<const uint8_t *>(blk.data);
+            size_t from = std::max(blk.off, begin);
+            size_t to = std::min(blk.off + blk.size, end);
+            size_t split = std::clamp(blk.off + blk.copied, from, to);
+            if (split < to)
+                memcpy(out.buf + split, data + (split - blk.off), to - split);
+            if (from < split) {
+                hash(out.buf + fed, fed, from);
+                hash(data + (from - blk.off), from, split);
+                fed = split;
+            }
+            if (blk.off + blk.size > end)
+                break;
         }
+        hash(out.buf + fed, fed, end);
+    }
+
+    /******************
+     * Patch the image
+     ******************/
+
+    // Update checksum
+    if (id) {
+        if (!fused_id)
+            id_hash.feed(out.buf, 0, pos);
         memset(id, 0, BOOT_ID_SIZE);
-        memcpy(id, HASH_final(&ctx), boot.flags[SHA256_FLAG] ? SHA256_DIGEST_SIZE : SHA_DIGEST_SIZE);
+        memcpy(id, id_hash.final(), boot.flags[SHA256_FLAG] ? SHA256_DIGEST_SIZE : SHA_DIGEST_SIZE);
     }
 
     // Print new header info
     hdr->print();
 
     // Copy main header
-    if (boot.flags[AMONET_FLAG]) {
-        auto real_hdr_sz = std::min(hdr->hdr_space() - AMONET_MICROLOADER_SZ, hdr->hdr_size());
-        memcpy(out.buf + off.header + AMONET_MICROLOADER_SZ, hdr->raw_hdr(), real_hdr_sz);
-    } else {
-        memcpy(out.buf + off.header, hdr->raw_hdr(), hdr->hdr_size());
-    }
+    if (id)
+        copy_hdr(out.buf + off.header);
 
     if (boot.flags[AVB_FLAG]) {
         // Copy and patch AVB structures
@@ -820,7 +1577,9 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         auto d_hdr = reinterpret_cast<dhtb_hdr *>(out.buf);
         memcpy(d_hdr, DHTB_MAGIC, 8);
         d_hdr->size = off.total - sizeof(dhtb_hdr);
-        SHA256_hash(out.buf + sizeof(dhtb_hdr), d_hdr->size, d_hdr->checksum);
+        if (!fused_dhtb)
+            dhtb_hash.feed(out.buf, 0, pos);
+        memcpy(d_hdr->checksum, dhtb_hash.final(), SHA256_DIGEST_SIZE);
     } else if (boot.flags[BLOB_FLAG]) {
         // Blob header
         auto b_hdr = reinterpret_cast<blob_hdr *>(out.buf);
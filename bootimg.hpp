@@ -625,6 +625,8 @@ struct boot_img {
     size_t ignore_size = 0;
 
     boot_img(const char *);
+    // No image mapped, only to parse headers read separately
+    boot_img() : hdr(nullptr) {}
     ~boot_img();
 
     void parse_image(const uint8_t *addr, format_t type);
@@ -14,14 +14,13 @@
 
 #include "magiskboot.hpp"
 #include "compress.hpp"
+#include "hash.hpp"
 
 using namespace std;
 
 #define bwrite this->base->write
-#define crc32_z crc32
 
 constexpr size_t CHUNK = 0x40000;
-constexpr size_t LZ4_UNCOMPRESSED = 0x800000;
 constexpr size_t LZ4_COMPRESSED = LZ4_COMPRESSBOUND(LZ4_UNCOMPRESSED);
 
 class out_stream : public filter_stream {
@@ -32,42 +31,39 @@ class out_stream : public filter_stream {
 class gz_strm : public out_stream {
 public:
     bool write(const void *buf, size_t len) override {
-        return len == 0 || do_write(buf, len, Z_NO_FLUSH);
+        if (len == 0)
+            return true;
+        return mode == ENCODE ? deflate_write(buf, len, Z_NO_FLUSH) : decode(buf, len);
     }
 
     ~gz_strm() override {
-        do_write(nullptr, 0, Z_FINISH);
         switch(mode) {
         case DECODE:
             inflateEnd(&strm);
             break;
         case ENCODE:
+            deflate_write(nullptr, 0, Z_FINISH);
             deflateEnd(&strm);
             break;
-        default:
-            break;
         }
     }
 
 protected:
     enum mode_t {
         DECODE,
-        ENCODE,
-        WAIT,
-        COPY
+        ENCODE
     } mode;
 
     gz_strm(mode_t mode, stream_ptr &&base) :
         out_stream(std::move(base)), mode(mode), strm{}, outbuf{0} {
         switch(mode) {
         case DECODE:
-            inflateInit2(&strm, 15 | 16);
+            // Members are framed here, so that the CRC goes through crc32_fast
+            inflateInit2(&strm, -15);
             break;
         case ENCODE:
             deflateInit2(&strm, 9, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
             break;
-        default:
-            break;
         }
     }
 
@@ -75,72 +71,141 @@ private:
     z_stream strm;
     uint8_t outbuf[CHUNK];
 
-    bool do_write(const void *buf, size_t len, int flush) {
-        if (mode == WAIT) {
-            if (len == 0) return true;
-            Bytef b[1] = {0x1f};
-            if (*(Bytef *)buf == 0x8b) {
-                mode = DECODE;
-                inflateReset(&strm);
-                strm.next_in = b;
-                strm.avail_in = 1;
-                inflate(&strm, flush);
-            } else {
-                mode = COPY;
-                return true;
-            }
-        }
+    // Decoder state within the current gzip member
+    enum {
+        HEADER,
+        BODY,
+        TRAILER,
+        // Data after the last member is ignored
+        IGNORE
+    } part = HEADER;
+    // Header or trailer bytes received so far
+    vector<uint8_t> frame;
+    uint32_t crc = 0;
+    uint32_t isize = 0;
+    int members = 0;
+
+    bool deflate_write(const void *buf, size_t len, int flush) {
         strm.next_in = (Bytef *) buf;
         strm.avail_in = len;
         do {
-            int code;
             strm.next_out = outbuf;
             strm.avail_out = sizeof(outbuf);
-            switch(mode) {
-                case DECODE:
-                    code = inflate(&strm, flush);
-                    break;
-                case ENCODE:
-                    code = deflate(&strm, flush);
-                    break;
-                case COPY:
-                    return true;
-                default:
-                    // should have been handled
-                    return false;
-            }
+            int code = deflate(&strm, flush);
             if (code == Z_STREAM_ERROR) {
-                LOGW("gzip %s failed (%d)\n", mode ? "encode" : "decode", code);
+                LOGW("gzip encode failed (%d)\n", code);
                 return false;
             }
             if (!bwrite(outbuf, sizeof(outbuf) - strm.avail_out))
                 return false;
-            if (mode == DECODE && code == Z_STREAM_END) {
-                if (strm.avail_in > 1) {
-                    if (strm.next_in[0] == 0x1f && strm.next_in[1] == 0x8b) {
-                        // There is still data in the stream, we need to reset the stream
-                        // and continue decoding
-                        inflateReset(&strm);
-                        strm.avail_out = 0;
-                        continue;
-                    }
-                } else if (strm.avail_in == 1) {
-                    if (strm.next_in[0] == 0x1f) {
-                        // If there is only one byte left, we need to wait for the next byte
-                        // to determine if it is a gzip header
-                        mode = WAIT;
-                        return true;
+        } while (strm.avail_out == 0);
+        return true;
+    }
+
+    // Size of the member header in frame once it is complete, 0 if more bytes are
+    // needed, or -1 if it is not a gzip header
+    ssize_t header_size() const {
+        const uint8_t *h = frame.data();
+        size_t n = frame.size();
+        if ((n > 0 && h[0] != 0x1f) || (n > 1 && h[1] != 0x8b) || (n > 2 && h[2] != Z_DEFLATED))
+            return -1;
+        if (n < 10)
+            return 0;
+        uint8_t flags = h[3];
+        size_t pos = 10;
+        if (flags & 0x04) {
+            // FEXTRA
+            if (n < pos + 2)
+                return 0;
+            pos += 2 + (h[pos] | (h[pos + 1] << 8));
+        }
+        for (uint8_t flag : { 0x08, 0x10 }) {
+            // FNAME and FCOMMENT, zero terminated
+            if (!(flags & flag))
+                continue;
+            while (pos < n && h[pos])
+                ++pos;
+            if (pos++ >= n)
+                return 0;
+        }
+        if (flags & 0x02) {
+            // FHCRC
+            pos += 2;
+        }
+        return n >= pos ? pos : 0;
+    }
+
+    bool decode(const void *buf, size_t len) {
+        auto in = static_cast<const uint8_t *>(buf);
+        while (len) {
+            switch (part) {
+            case HEADER: {
+                frame.push_back(*in++);
+                --len;
+                ssize_t size = header_size();
+                if (size < 0) {
+                    if (members == 0) {
+                        LOGW("gzip decode failed: bad header\n");
+                        return false;
                     }
-                } else {
-                    // The next inflate won't consume any data but fallback
-                    // to the previous two conditions
+                    part = IGNORE;
                     return true;
                 }
-                // There is still data in the stream, we need to copy it
-                mode = COPY;
+                if (size > 0) {
+                    frame.clear();
+                    crc = 0;
+                    isize = 0;
+                    inflateReset(&strm);
+                    part = BODY;
+                }
+                break;
+            }
+            case BODY: {
+                strm.next_in = (Bytef *) in;
+                strm.avail_in = len;
+                int code;
+                do {
+                    strm.next_out = outbuf;
+                    strm.avail_out = sizeof(outbuf);
+                    code = inflate(&strm, Z_NO_FLUSH);
+                    if (code != Z_OK && code != Z_STREAM_END && code != Z_BUF_ERROR) {
+                        LOGW("gzip decode failed (%d)\n", code);
+                        return false;
+                    }
+                    size_t n = sizeof(outbuf) - strm.avail_out;
+                    crc = crc32_fast(crc, outbuf, n);
+                    isize += n;
+                    if (!bwrite(outbuf, n))
+                        return false;
+                } while (code != Z_STREAM_END && strm.avail_out == 0);
+                in = strm.next_in;
+                len = strm.avail_in;
+                if (code == Z_STREAM_END)
+                    part = TRAILER;
+                break;
+            }
+            case TRAILER: {
+                size_t n = std::min(8 - frame.size(), len);
+                frame.insert(frame.end(), in, in + n);
+                in += n;
+                len -= n;
+                if (frame.size() < 8)
+                    break;
+                auto f = frame.data();
+                if ((f[0] | f[1] << 8 | f[2] << 16 | (uint32_t) f[3] << 24) != crc ||
+                    (f[4] | f[5] << 8 | f[6] << 16 | (uint32_t) f[7] << 24) != isize) {
+                    LOGW("gzip decode failed: checksum mismatch\n");
+                    return false;
+                }
+                frame.clear();
+                ++members;
+                part = HEADER;
+                break;
+            }
+            case IGNORE:
                 return true;
             }
-        } while (strm.avail_out == 0);
+        }
         return true;
     }
 };
@@ -159,7 +224,7 @@ class zopfli_encoder : public chunk_out_stream {
 public:
     explicit zopfli_encoder(stream_ptr &&base) :
         chunk_out_stream(std::move(base), ZOPFLI_MASTER_BLOCK_SIZE),
-        zo{}, out(nullptr), outsize(0), crc(crc32_z(0L, Z_NULL, 0)), in_total(0), bp(0) {
+        zo{}, out(nullptr), outsize(0), crc(0), in_total(0), bp(0) {
         ZopfliInitOptions(&zo);
 
         // This config is already better than gzip -9
@@ -207,7 +272,7 @@ protected:
         auto in = static_cast<const unsigned char *>(buf);
 
         in_total += len;
-        crc = crc32_z(crc, in, len);
+        crc = crc32_fast(crc, in, len);
 
         ZopfliDeflatePart(&zo, 2, final, in, 0, len, &bp, &out, &outsize);
 
@@ -4,6 +4,9 @@
 
 #include "format.hpp"
 
+// Uncompressed size of every block of an lz4 legacy stream but the last one
+constexpr size_t LZ4_UNCOMPRESSED = 0x800000;
+
 filter_strm_ptr get_encoder(format_t type, stream_ptr &&base);
 
 filter_strm_ptr get_decoder(format_t type, stream_ptr &&base);
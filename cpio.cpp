@@ -1,11 +1,29 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <sys/uio.h>
+#include <inttypes.h>
 #include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define NEWC_NEON
+#endif
 
 #include <base.hpp>
+#include <stream.hpp>
+#include <xxhash.h>
+#include <lz4.h>
 
 #include "cpio.hpp"
+#include "magiskboot.hpp"
+#include "scan.hpp"
 
 using namespace std;
 
@@ -26,111 +44,641 @@ struct cpio_newc_header {
     char check[8];
 } __attribute__((packed));
 
-static uint32_t x8u(const char *hex) {
-    uint32_t val, inpos = 8, outpos;
-    char pattern[6];
+#define NEWC_MAGIC "070701"
+
+// Header fields in on-disk order, all of them 8 hex digits wide
+enum {
+    NEWC_INO,
+    NEWC_MODE,
+    NEWC_UID,
+    NEWC_GID,
+    NEWC_NLINK,
+    NEWC_MTIME,
+    NEWC_FILESIZE,
+    NEWC_DEVMAJOR,
+    NEWC_DEVMINOR,
+    NEWC_RDEVMAJOR,
+    NEWC_RDEVMINOR,
+    NEWC_NAMESIZE,
+    NEWC_CHECK,
+    NEWC_FIELDS
+};
 
-    while (*hex == '0') {
-        hex++;
-        if (!--inpos) return 0;
+static inline uint32_t load_be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Strict hex parsing: exactly 8 digits, either case, nothing else
+static bool hex8_decode(const char *in, uint32_t *out) {
+    uint32_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        uint8_t c = in[i];
+        uint8_t d = c - '0';
+        uint8_t a = (c | 0x20) - 'a';
+        if (d < 10)
+            v = v << 4 | d;
+        else if (a < 6)
+            v = v << 4 | (a + 10);
+        else
+            return false;
     }
-    // Because scanf gratuitously treats %*X differently than printf does.
-    sprintf(pattern, "%%%dx%%n", inpos);
-    sscanf(hex, pattern, &val, &outpos);
-    if (inpos != outpos)
-        LOGE("bad cpio header\n");
+    *out = v;
+    return true;
+}
 
-    return val;
+static void hex8_encode(uint32_t v, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 7; i >= 0; --i, v >>= 4)
+        out[i] = digits[v & 0xf];
 }
 
-cpio_entry::cpio_entry(uint32_t mode) : mode(mode), uid(0), gid(0), filesize(0), data(nullptr) {}
+// Two adjacent fields at once, 16 hex digits <-> 8 bytes
+#if defined(__SSE2__)
+
+static bool hex16_decode(const char *in, uint32_t *out) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    // Bytes >= 0x80 are negative, so signed compares reject them as well
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+    if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+        return false;
+    __m128i n = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                             _mm_and_si128(alpha, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+    // Each 16-bit lane holds (high nibble, low nibble), merge them into one byte
+    n = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0xff)), 4),
+                     _mm_srli_epi16(n, 8));
+    uint8_t b[8];
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(b), _mm_packus_epi16(n, n));
+    out[0] = load_be32(b);
+    out[1] = load_be32(b + 4);
+    return true;
+}
 
-cpio_entry::cpio_entry(uint32_t mode, uint32_t uid, uint32_t gid) : mode(mode), uid(uid), gid(gid), filesize(0), data(nullptr) {}
+static void hex16_encode(const uint32_t *in, char *out) {
+    uint8_t b[8];
+    store_be32(b, in[0]);
+    store_be32(b + 4, in[1]);
+    __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(b));
+    __m128i mask = _mm_set1_epi8(0xf);
+    __m128i n = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), mask), _mm_and_si128(v, mask));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    n = _mm_add_epi8(n, _mm_add_epi8(alpha, _mm_set1_epi8('0')));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), n);
+}
 
-cpio_entry::cpio_entry(const cpio_newc_header *h) :
-mode(x8u(h->mode)), uid(x8u(h->uid)), gid(x8u(h->gid)), filesize(x8u(h->filesize)), data(nullptr)
-{}
+#elif defined(NEWC_NEON)
 
-static void recursive_dir_iterator(cpio::entry_map &entries, const char* root, const char *sub = nullptr) {
-    auto path = sub ? sub : root;
-    auto cur = opendir(path);
+static bool hex16_decode(const char *in, uint32_t *out) {
+    uint8x16_t c = vld1q_u8(reinterpret_cast<const uint8_t *>(in));
+    uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t a = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t digit = vcleq_u8(d, vdupq_n_u8(9));
+    uint8x16_t ok = vorrq_u8(digit, vcleq_u8(a, vdupq_n_u8(5)));
+    uint8x8_t all = vand_u8(vget_low_u8(ok), vget_high_u8(ok));
+    if (vget_lane_u64(vreinterpret_u64_u8(all), 0) != ~0ULL)
+        return false;
+    uint16x8_t n = vreinterpretq_u16_u8(vbslq_u8(digit, d, vaddq_u8(a, vdupq_n_u8(10))));
+    // Each 16-bit lane holds (high nibble, low nibble), merge them into one byte
+    n = vorrq_u16(vshlq_n_u16(vandq_u16(n, vdupq_n_u16(0xff)), 4), vshrq_n_u16(n, 8));
+    uint8_t b[8];
+    vst1_u8(b, vmovn_u16(n));
+    out[0] = load_be32(b);
+    out[1] = load_be32(b + 4);
+    return true;
+}
 
-    if (errno || !cur)
-        return;
+static void hex16_encode(const uint32_t *in, char *out) {
+    uint8_t b[8];
+    store_be32(b, in[0]);
+    store_be32(b + 4, in[1]);
+    uint8x8_t v = vld1_u8(b);
+    uint8x8x2_t z = vzip_u8(vshr_n_u8(v, 4), vand_u8(v, vdup_n_u8(0xf)));
+    uint8x16_t n = vcombine_u8(z.val[0], z.val[1]);
+    uint8x16_t alpha = vandq_u8(vcgtq_u8(n, vdupq_n_u8(9)), vdupq_n_u8('a' - '0' - 10));
+    n = vaddq_u8(n, vaddq_u8(alpha, vdupq_n_u8('0')));
+    vst1q_u8(reinterpret_cast<uint8_t *>(out), n);
+}
 
-    for (dirent *entry; (entry = xreaddir(cur));) {
-        char *filename = (char *)malloc(strlen(path) + 2 +
-#ifndef SVB_MINGW
-        strlen(entry->d_name));
 #else
-        entry->d_namlen);
+
+static bool hex16_decode(const char *in, uint32_t *out) {
+    return hex8_decode(in, out) && hex8_decode(in + 8, out + 1);
+}
+
+static void hex16_encode(const uint32_t *in, char *out) {
+    hex8_encode(in[0], out);
+    hex8_encode(in[1], out + 8);
+}
+
+#endif
+
+static bool newc_decode(const cpio_newc_header *h, uint32_t *f) {
+    if (memcmp(h->magic, NEWC_MAGIC, 6) != 0)
+        return false;
+    const char *p = h->ino;
+    int i = 0;
+    for (; i + 1 < NEWC_FIELDS; i += 2) {
+        if (!hex16_decode(p + i * 8, f + i))
+            return false;
+    }
+    return hex8_decode(p + i * 8, f + i);
+}
+
+static void newc_encode(const uint32_t *f, cpio_newc_header *h) {
+    memcpy(h->magic, NEWC_MAGIC, 6);
+    char *p = h->ino;
+    int i = 0;
+    for (; i + 1 < NEWC_FIELDS; i += 2)
+        hex16_encode(f + i, p + i * 8);
+    hex8_encode(f[i], p + i * 8);
+}
+
+cpio_entry::cpio_entry(uint32_t mode) : mode(mode), uid(0), gid(0), filesize(0), data(nullptr), map_sz(0), link(0), borrowed(false) {}
+
+cpio_entry::cpio_entry(uint32_t mode, uint32_t uid, uint32_t gid) : mode(mode), uid(uid), gid(gid), filesize(0), data(nullptr), map_sz(0), link(0), borrowed(false) {}
+
+// Hardlink group ids are unique process wide, entries keep them when moved between archives
+static uint32_t next_link = 1;
+
+cpio_entry::cpio_entry(cpio_entry &&e) :
+mode(e.mode), uid(e.uid), gid(e.gid), filesize(e.filesize), data(e.data), map_sz(e.map_sz), link(e.link), borrowed(e.borrowed) {
+    e.data = nullptr;
+    e.map_sz = 0;
+    e.borrowed = false;
+}
+
+void cpio_entry::free_data() {
+    if (map_sz)
+        munmap(data, map_sz);
+    else if (!borrowed)
+        free(data);
+    data = nullptr;
+    map_sz = 0;
+    borrowed = false;
+}
+
+// Move mapped data to the heap, so the backing file can be overwritten
+void cpio_entry::materialize() {
+    if (!map_sz && !borrowed)
+        return;
+    void *buf = xmalloc(filesize);
+    memcpy(buf, data, filesize);
+    free_data();
+    data = buf;
+}
+
+string_view cpio_arena::str(string_view s) {
+    size_t len = s.size() + 1;
+    char *p;
+    if (len > BLOCK_SZ / 4) {
+        // Do not waste the current block on huge strings
+        blocks.emplace_back(new char[len]);
+        p = blocks.back().get();
+    } else {
+        if (len > avail) {
+            blocks.emplace_back(new char[BLOCK_SZ]);
+            cur = blocks.back().get();
+            avail = BLOCK_SZ;
+        }
+        p = cur;
+        cur += len;
+        avail -= len;
+    }
+    memcpy(p, s.data(), s.size());
+    p[s.size()] = '\0';
+    return { p, s.size() };
+}
+
+cpio_entry *cpio_arena::next_entry() {
+    if (slab_used == SLAB_SZ) {
+        slabs.emplace_back(new cpio_entry[SLAB_SZ]);
+        slab_used = 0;
+    }
+    return &slabs.back()[slab_used++];
+}
+
+static bool entry_cmp(const cpio::entry_t &e, string_view name) {
+    return e.first < name;
+}
+
+static cpio::entry_map::iterator find_entry(cpio::entry_map &entries, string_view name) {
+    auto it = lower_bound(entries.begin(), entries.end(), name, entry_cmp);
+    if (it != entries.end() && it->first == name)
+        return it;
+    return entries.end();
+}
+
+#if !defined(SVB_WIN32) && !defined(SVB_MINGW)
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
 #endif
+
+// Sync state, written next to the extracted directory. It remembers what every regular
+// file looked like on disk, and which archive file the extracted tree came from. While
+// that archive is the one loaded, sync can skip reading files that were not touched since.
+struct file_state {
+    uint64_t size;
+    uint32_t mode;
+    uint64_t ino;
+    timespec mtime;
+    timespec ctime;
+};
+
+// Identity of an archive file, the hash covers its whole content
+struct archive_id {
+    uint64_t size;
+    timespec mtime;
+    uint64_t hash;
+};
+
+struct sync_state {
+    unordered_map<string, file_state> files;
+    bool has_archive = false;
+    archive_id archive;
+    // Anything modified at or after this moment cannot be trusted to be unchanged
+    timespec written{};
+};
+
+static file_state make_state(const struct stat &st) {
+    return { (uint64_t) st.st_size, st.st_mode, (uint64_t) st.st_ino, st.st_mtim, st.st_ctim };
+}
+
+static bool ts_equal(const timespec &a, const timespec &b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool ts_before(const timespec &a, const timespec &b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static bool stat_archive(const char *file, archive_id &id) {
+    struct stat st;
+    if (stat(file, &st) < 0)
+        return false;
+    id.size = st.st_size;
+    id.mtime = st.st_mtim;
+    return true;
+}
+
+static uint64_t hash_archive(const char *file) {
+    auto m = mmap_data(file);
+    return XXH64(m.buf, m.sz, 0);
+}
+
+// Whether file is still the archive recorded in the state, its content is
+// only hashed once the size and modification time match
+static bool same_archive(const char *file, const archive_id &id) {
+    archive_id cur;
+    return stat_archive(file, cur) && cur.size == id.size && ts_equal(cur.mtime, id.mtime) &&
+           hash_archive(file) == id.hash;
+}
+
+// The archive line comes last, sync appends it once the archive is dumped
+static void write_archive_id(FILE *fp, const char *file) {
+    archive_id id;
+    if (!stat_archive(file, id))
+        return;
+    id.hash = hash_archive(file);
+    fprintf(fp, "archive %" PRIu64 " %lld.%09ld %016" PRIx64 "\n",
+            id.size, (long long) id.mtime.tv_sec, id.mtime.tv_nsec, id.hash);
+}
+
+static void write_state(const char *file, const vector<pair<string_view, file_state>> &states,
+                        const char *archive = nullptr) {
+    auto fp = xopen_file(file, "we");
+    if (!fp)
+        return;
+    for (auto &[name, s] : states) {
+        // The state is only an optimization, names it cannot represent are always read
+        if (name.find('\n') != string_view::npos)
+            continue;
+        fprintf(fp.get(), "%" PRIu64 " %o %" PRIu64 " %lld.%09ld %lld.%09ld %s\n",
+                s.size, s.mode, s.ino,
+                (long long) s.mtime.tv_sec, s.mtime.tv_nsec,
+                (long long) s.ctime.tv_sec, s.ctime.tv_nsec, name.data());
+    }
+    if (archive)
+        write_archive_id(fp.get(), archive);
+}
+
+static sync_state read_state(const char *file) {
+    sync_state state;
+    struct stat st;
+    if (stat(file, &st) < 0)
+        return state;
+    state.written = st.st_mtim;
+    file_readline(true, file, [&](string_view line) -> bool {
+        long long msec, csec;
+        if (str_starts(line, "archive ")) {
+            auto &id = state.archive;
+            state.has_archive = sscanf(line.data(), "archive %" SCNu64 " %lld.%ld %" SCNx64,
+                                       &id.size, &msec, &id.mtime.tv_nsec, &id.hash) == 4;
+            id.mtime.tv_sec = msec;
+            return true;
+        }
+        file_state s;
+        int name_off = 0;
+        if (sscanf(line.data(), "%" SCNu64 " %o %" SCNu64 " %lld.%ld %lld.%ld %n",
+                   &s.size, &s.mode, &s.ino, &msec, &s.mtime.tv_nsec,
+                   &csec, &s.ctime.tv_nsec, &name_off) == 7 && name_off > 0) {
+            s.mtime.tv_sec = msec;
+            s.ctime.tv_sec = csec;
+            state.files.emplace(line.substr(name_off), s);
+        }
+        return true;
+    });
+    return state;
+}
+
+// Regular files at least this large are kept mapped instead of copied
+#define PACK_MMAP_MIN (16 * 1024)
+
+struct pack_file {
+    size_t idx;
+    struct stat st;
+};
+
+// Collect entries below dirfd, names are relative to the directory being packed.
+// Regular files only get their size here, data is read afterwards.
+static bool walk_dir(cpio_arena &arena, cpio::entry_map &entries, vector<pack_file> &files,
+                     vector<cpio::mapped_file> &mapped, map<pair<dev_t, ino_t>, uint32_t> &links,
+                     int dirfd, string &path) {
+    DIR *dir = xfdopendir(dirfd);
+    if (!dir) {
+        close(dirfd);
+        return false;
+    }
+    bool ok = true;
+    size_t len = path.size();
+    for (dirent *entry; ok && (entry = xreaddir(dir));) {
         struct stat st;
+        if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            ok = false;
+            break;
+        }
 
-        if (sprintf(filename, "%s/%s", path, entry->d_name) < 0 ||
-            xlstat(filename, &st)) {
-            errno = EINVAL;
+        path.resize(len);
+        path += entry->d_name;
+        auto e = arena.entry(st.st_mode, st.st_uid, st.st_gid);
+        entries.emplace_back(arena.str(path), e);
+
+        switch (st.st_mode & S_IFMT) {
+        case S_IFREG:
+            e->filesize = st.st_size;
+            files.push_back({ entries.size() - 1, st });
+            if (st.st_nlink > 1) {
+                auto &link = links[{ st.st_dev, st.st_ino }];
+                if (!link)
+                    link = next_link++;
+                e->link = link;
+            }
+            if (e->filesize >= PACK_MMAP_MIN)
+                mapped.push_back({ st.st_dev, st.st_ino, e });
+            break;
+        case S_IFLNK: {
+            auto target = static_cast<char *>(xmalloc(st.st_size + 1));
+            ssize_t read_cnt = readlinkat(dirfd, entry->d_name, target, st.st_size + 1);
+            if (read_cnt < 0 || read_cnt > st.st_size) {
+                free(target);
+                errno = EINVAL;
+                ok = false;
+                break;
+            }
+            e->filesize = read_cnt;
+            e->data = target;
+            break;
+        }
+        case S_IFDIR: {
+            int fd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            path += '/';
+            ok = fd >= 0 && walk_dir(arena, entries, files, mapped, links, fd, path);
+            break;
+        }
+        default:
+            // Special files carry no data
+            break;
+        }
+    }
+    closedir(dir);
+    path.resize(len);
+    return ok;
+}
+
+// Fill in the data of a regular file collected by walk_dir
+static void read_file(int root, const cpio::entry_t &ent) {
+    auto e = ent.second;
+    int fd = xopenat(root, ent.first.data(), O_RDONLY | O_CLOEXEC);
+    if (e->filesize >= PACK_MMAP_MIN) {
+        // Private writable mapping, patching in place never touches the file
+        void *p = mmap(nullptr, e->filesize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            e->data = p;
+            e->map_sz = e->filesize;
+            close(fd);
+            return;
+        }
+    }
+    e->data = xmalloc(e->filesize);
+    xxread(fd, e->data, e->filesize);
+    close(fd);
+}
+#else
+// Collect entries below path by name, for platforms without directory file descriptors.
+// Names are relative to the directory being packed, data is read right away.
+static bool walk_path(cpio_arena &arena, cpio::entry_map &entries, string &path, size_t root_len) {
+    DIR *dir = opendir(path.data());
+    if (!dir)
+        return false;
+    bool ok = true;
+    size_t len = path.size();
+    for (dirent *entry; ok && (entry = xreaddir(dir));) {
+        path.resize(len);
+        path += '/';
+        path += entry->d_name;
+        struct stat st;
+        if (xlstat(path.data(), &st) < 0) {
+            ok = false;
             break;
         }
 
-        auto e = new cpio_entry(st.st_mode, st.st_uid, st.st_gid);
-        auto name = filename + strlen(root) + 1;
-        auto type = st.st_mode & S_IFMT;
+        auto e = arena.entry(st.st_mode, st.st_uid, st.st_gid);
+        entries.emplace_back(arena.str(string_view(path).substr(root_len)), e);
 
-        if (type == S_IFREG) {
-            auto m = mmap_data(filename);
+        switch (st.st_mode & S_IFMT) {
+        case S_IFREG: {
+            auto m = mmap_data(path.data());
             e->filesize = m.sz;
             e->data = xmalloc(m.sz);
             memcpy(e->data, m.buf, m.sz);
-        } else if (type == S_IFLNK) {
-            char* ln_target = (char *)malloc(st.st_size + 1);
-            int read_cnt = xreadlink(filename, ln_target, st.st_size);
-
-            if (read_cnt == -1 || read_cnt > st.st_size) {
+            break;
+        }
+        case S_IFLNK: {
+            auto target = static_cast<char *>(xmalloc(st.st_size + 1));
+            ssize_t read_cnt = xreadlink(path.data(), target, st.st_size + 1);
+            if (read_cnt < 0 || read_cnt > st.st_size) {
+                free(target);
                 errno = EINVAL;
-                return;
+                ok = false;
+                break;
             }
-            e->filesize = st.st_size;
-            e->data = ln_target;
-        } else { // assume S_IFDIR
-            recursive_dir_iterator(entries, root, filename);
+            e->filesize = read_cnt;
+            e->data = target;
+            break;
         }
+        case S_IFDIR:
+            ok = walk_path(arena, entries, path, root_len);
+            break;
+        default:
+            // Special files carry no data
+            break;
+        }
+    }
+    closedir(dir);
+    path.resize(len);
+    return ok;
+}
+#endif
+
+// Only counts how large the archive would be after LZ4 compression,
+// used to compare entry orders without writing anything
+#define LZ4_EST_BLOCK 0x800000
+
+class lz4_size_stream : public stream {
+public:
+    lz4_size_stream() : buf(new char[LZ4_EST_BLOCK]), out(new char[LZ4_COMPRESSBOUND(LZ4_EST_BLOCK)]) {}
+    ~lz4_size_stream() override {
+        delete[] buf;
+        delete[] out;
+    }
+
+    bool write(const void *in, size_t len) override {
+        auto p = static_cast<const char *>(in);
+        while (len) {
+            size_t n = std::min(len, LZ4_EST_BLOCK - buf_off);
+            memcpy(buf + buf_off, p, n);
+            buf_off += n;
+            p += n;
+            len -= n;
+            if (buf_off == LZ4_EST_BLOCK)
+                flush();
+        }
+        return true;
+    }
+
+    static size_t estimate(cpio &c, const vector<cpio::dump_slot> &plan) {
+        lz4_size_stream s;
+        c.dump(s, plan);
+        s.flush();
+        return s.total;
+    }
 
-        entries.emplace(name, e);
-        free(filename);
+private:
+    void flush() {
+        if (buf_off)
+            total += LZ4_compress_default(buf, out, buf_off, LZ4_COMPRESSBOUND(LZ4_EST_BLOCK));
+        buf_off = 0;
     }
 
-    closedir(cur);
+    char *buf;
+    char *out;
+    size_t buf_off = 0;
+    size_t total = 0;
+};
+
+// Reserve space for the whole archive up front, this is only a hint.
+// The file size is left alone, so a short dump never ends with zeros.
+static void preallocate(int fd, size_t size) {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#elif defined(__APPLE__)
+    fstore_t fst = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t) size, 0 };
+    if (fcntl(fd, F_PREALLOCATE, &fst) < 0) {
+        fst.fst_flags = F_ALLOCATEALL;
+        fcntl(fd, F_PREALLOCATE, &fst);
+    }
+#endif
 }
 
 void cpio::dump(const char *file) {
     fprintf(stderr, "Dump cpio: [%s]\n", file);
-    dump(xfopen(file, "we"));
+    load_entries();
+    int fd = xopen(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    // Packed files may still be mapped, never truncate one of them underneath us
+    struct stat st;
+    fstat(fd, &st);
+    for (auto &m : mapped) {
+        if (m.dev == st.st_dev && m.ino == st.st_ino)
+            m.e->materialize();
+    }
+    for (auto &a : archives) {
+        if (a.dev == st.st_dev && a.ino == st.st_ino) {
+            for (auto &e : entries)
+                e.second->materialize();
+            break;
+        }
+    }
+    ftruncate(fd, 0);
+    auto plan = plan_dump(reorder);
+    if (reorder) {
+        size_t sorted = lz4_size_stream::estimate(*this, plan_dump(false));
+        size_t clustered = lz4_size_stream::estimate(*this, plan);
+        fprintf(stderr, "Reorder: estimated LZ4 size [%zu] -> [%zu] (%+.2f%%)\n",
+                sorted, clustered, sorted ? (clustered * 100.0 / sorted - 100.0) : 0.0);
+    }
+    preallocate(fd, dump_size(plan));
+    fd_stream out(fd);
+    dump(out, plan);
+    close(fd);
+#if !defined(SVB_WIN32) && !defined(SVB_MINGW)
+    if (!pending_state.empty()) {
+        if (auto fp = xopen_file(pending_state.data(), "ae"))
+            write_archive_id(fp.get(), file);
+        pending_state.clear();
+    }
+#endif
+}
+
+cpio::entry_map::iterator cpio::find(string_view name) {
+    return find_entry(entries, name);
 }
 
-void cpio::rm(entry_map::iterator it) {
+cpio::entry_map::iterator cpio::rm(entry_map::iterator it) {
     if (it == entries.end())
-        return;
+        return it;
     fprintf(stderr, "Remove [%s]\n", it->first.data());
-    entries.erase(it);
+    modified();
+    it->second->free_data();
+    return entries.erase(it);
 }
 
 void cpio::rm(const char *name, bool r) {
-    size_t len = strlen(name);
-    for (auto it = entries.begin(); it != entries.end();) {
-        if (it->first.compare(0, len, name) == 0 &&
-            ((r && it->first[len] == '/') || it->first[len] == '\0')) {
-            auto tmp = it;
-            ++it;
-            rm(tmp);
-            if (!r) return;
-        } else {
-            ++it;
-        }
+    load_entries();
+    rm(find(name));
+    if (!r)
+        return;
+    // All children are stored contiguously right after "name/"
+    string prefix = string(name) + '/';
+    auto first = lower_bound(entries.begin(), entries.end(), prefix, entry_cmp);
+    auto last = first;
+    for (; last != entries.end() && str_starts(last->first, prefix); ++last) {
+        fprintf(stderr, "Remove [%s]\n", last->first.data());
+        last->second->free_data();
     }
+    entries.erase(first, last);
 }
 
-void cpio::extract_entry(const entry_map::value_type &e, const char *file) {
+void cpio::extract_entry(const entry_t &e, const char *file) {
     fprintf(stderr, "Extract [%s] to [%s]\n", e.first.data(), file);
     unlink(file);
     rmdir(file);
@@ -159,7 +707,9 @@ void cpio::extract_entry(const entry_map::value_type &e, const char *file) {
 #endif
 }
 
+#if defined(SVB_WIN32) || defined(SVB_MINGW)
 void cpio::extract() {
+    load_entries();
     unlink("cpio");
     rmdir("ramdisk");
 #ifdef SVB_MINGW
@@ -168,19 +718,172 @@ void cpio::extract() {
     ::mkdir("ramdisk", 0744);
 #endif
     for (auto &e : entries)
-        extract_entry(e, ("ramdisk/" + e.first).data());
+        extract_entry(e, ("ramdisk/"s += e.first).data());
+}
+#else
+static string_view parent_of(string_view name) {
+    auto slash = name.rfind('/');
+    return slash == string_view::npos ? string_view() : name.substr(0, slash);
+}
+
+// Create missing ancestors of an entry, same as mkdir -p
+static void make_parents(int root, string_view dir, unordered_set<string_view> &dirs) {
+    if (dir.empty() || dirs.count(dir))
+        return;
+    make_parents(root, parent_of(dir), dirs);
+    xmkdirat(root, string(dir).data(), 0755);
+    dirs.insert(dir);
 }
 
+// Maximum number of files written by one extract job
+#define EXTRACT_JOB_SZ 64
+
+void cpio::extract() {
+    load_entries();
+    unlink("cpio");
+    rmdir("ramdisk");
+    ::mkdir("ramdisk", 0744);
+    int root = xopen("ramdisk", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    mode_t mask = umask(0);
+    umask(mask);
+
+    // Pass 1: create the directory skeleton in order, parents always sort before children.
+    // New directories stay accessible until every file is in place.
+    unordered_set<string_view> dirs;
+    vector<const entry_t *> new_dirs;
+    vector<const entry_t *> files;
+    for (auto &e : entries) {
+        fprintf(stderr, "Extract [%s] to [ramdisk/%s]\n", e.first.data(), e.first.data());
+        make_parents(root, parent_of(e.first), dirs);
+        if (S_ISDIR(e.second->mode)) {
+            unlinkat(root, e.first.data(), 0);
+            unlinkat(root, e.first.data(), AT_REMOVEDIR);
+            if (xmkdirat(root, e.first.data(), 0700) == 0)
+                new_dirs.push_back(&e);
+            dirs.insert(e.first);
+        } else if (S_ISREG(e.second->mode) || S_ISLNK(e.second->mode)) {
+            files.push_back(&e);
+        } else {
+            unlinkat(root, e.first.data(), 0);
+            unlinkat(root, e.first.data(), AT_REMOVEDIR);
+        }
+    }
+
+    // Pass 2: write files and symlinks on all cores. Entries are grouped by parent
+    // so each job resolves its directory once and works relative to it.
+    stable_sort(files.begin(), files.end(), [](const entry_t *a, const entry_t *b) {
+        return parent_of(a->first) < parent_of(b->first);
+    });
+    vector<pair<size_t, size_t>> jobs;
+    for (size_t i = 0; i < files.size();) {
+        auto parent = parent_of(files[i]->first);
+        size_t j = i + 1;
+        while (j < files.size() && j - i < EXTRACT_JOB_SZ && parent_of(files[j]->first) == parent)
+            ++j;
+        jobs.emplace_back(i, j);
+        i = j;
+    }
+    vector<pair<string_view, file_state>> states(files.size());
+    parallel_for(jobs.size(), [&](size_t n) {
+        auto parent = parent_of(files[jobs[n].first]->first);
+        int dirfd = parent.empty() ? root :
+                xopenat(root, string(parent).data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        for (size_t i = jobs[n].first; i < jobs[n].second; ++i) {
+            auto &e = *files[i];
+            const char *name = e.first.data() + (parent.empty() ? 0 : parent.size() + 1);
+            unlinkat(dirfd, name, 0);
+            unlinkat(dirfd, name, AT_REMOVEDIR);
+            if (S_ISREG(e.second->mode)) {
+                int fd = xopenat(dirfd, name, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, e.second->mode & 0777);
+                xwrite(fd, e.second->data, e.second->filesize);
+                fchown(fd, e.second->uid, e.second->gid);
+                struct stat st;
+                if (fstat(fd, &st) == 0)
+                    states[i] = { e.first, make_state(st) };
+                close(fd);
+            } else if (e.second->filesize < 4096) {
+                string target(static_cast<char *>(e.second->data), e.second->filesize);
+                symlinkat(target.data(), dirfd, name);
+            }
+        }
+        if (dirfd != root)
+            close(dirfd);
+    });
+
+    // Pass 3: apply the final directory modes, children first
+    for (auto e : reversed(new_dirs))
+        fchmodat(root, e->first.data(), e->second->mode & 0777 & ~mask, 0);
+    close(root);
+
+    states.erase(remove_if(states.begin(), states.end(), [](auto &s) { return s.first.empty(); }),
+                 states.end());
+    // The tree only matches the archive file if nothing was changed since it was loaded
+    write_state("ramdisk" STATE_EXT, states, origin.empty() ? nullptr : origin.data());
+}
+#endif
+
 void cpio::load_cpio(const char* dir, const char* config, bool sync) {
+    load_entries();
     entry_map dentries;
+    unordered_set<const cpio_entry *> clean;
+#if defined(SVB_WIN32) || defined(SVB_MINGW)
+    string path = dir;
+    if (!walk_path(arena, dentries, path, path.size() + 1)) {
+        PLOGE("%s [%s]", sync ? "Sync" : "Pack", dir);
+        return;
+    }
+#else
+    vector<pack_file> files;
+    map<pair<dev_t, ino_t>, uint32_t> links;
+    string path;
 
-    recursive_dir_iterator(dentries, dir);
-
-    if (errno) {
+    int root = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root < 0 || !walk_dir(arena, dentries, files, mapped, links, dup(root), path)) {
         PLOGE("%s [%s]", sync ? "Sync" : "Pack", dir);
         return;
     }
 
+    // While the loaded archive is the one the tree was extracted from, files that still
+    // match the state are identical to the entry of the same name, they are never read
+    string state_file = dir + ""s + STATE_EXT;
+    if (sync && !origin.empty()) {
+        auto state = read_state(state_file.data());
+        if (state.has_archive && same_archive(origin.data(), state.archive)) {
+            for (auto &f : files) {
+                auto &[name, e] = dentries[f.idx];
+                auto &st = f.st;
+                auto s = state.files.find(string(name));
+                if (s == state.files.end() || s->second.size != (uint64_t) st.st_size ||
+                    s->second.mode != st.st_mode || s->second.ino != (uint64_t) st.st_ino ||
+                    !ts_equal(s->second.mtime, st.st_mtim) || !ts_equal(s->second.ctime, st.st_ctim) ||
+                    !ts_before(st.st_mtim, state.written) || !ts_before(st.st_ctim, state.written))
+                    continue;
+                auto it = find(name);
+                if (it == entries.end() || !S_ISREG(it->second->mode) || it->second->filesize != e->filesize)
+                    continue;
+                clean.insert(e);
+            }
+        }
+    }
+
+    parallel_for(files.size(), [&](size_t i) {
+        auto &ent = dentries[files[i].idx];
+        if (!clean.count(ent.second))
+            read_file(root, ent);
+    });
+    close(root);
+
+    vector<pair<string_view, file_state>> states;
+    if (sync) {
+        for (auto &f : files)
+            states.emplace_back(dentries[f.idx].first, make_state(f.st));
+    }
+#endif
+
+    sort(dentries.begin(), dentries.end(), [](const entry_t &a, const entry_t &b) {
+        return a.first < b.first;
+    });
+
     file_readline(config, [&](string_view line) -> bool {
         if (line.empty() || line[0] == '#')
             return true;
@@ -191,7 +894,7 @@ void cpio::load_cpio(const char* dir, const char* config, bool sync) {
             LOGE("Ill-formed line in [%s]\n", config);
         }
 
-        auto it = dentries.find(tokens[0].data());
+        auto it = find_entry(dentries, tokens[0]);
         if (it != dentries.end()) {
             it->second->mode &= S_IFMT;
             it->second->mode |= static_cast<unsigned int>(strtol(tokens[1].data(), nullptr, 8)) & 0777;
@@ -203,6 +906,7 @@ void cpio::load_cpio(const char* dir, const char* config, bool sync) {
     });
 
     if (!sync) {
+        modified();
         entries = std::move(dentries);
         return;
     }
@@ -223,18 +927,31 @@ void cpio::load_cpio(const char* dir, const char* config, bool sync) {
         bool is_new = res >= 0;
 
         if (res < 0) { // smh is removed
-            rm(rhs++);
+            rhs = rm(rhs);
         } else if (res == 0) { // smh is same, maybe
             is_new = rhs->second->filesize != lhs->second->filesize ||
                      rhs->second->mode != lhs->second->mode ||
                      rhs->second->uid != lhs->second->uid ||
                      rhs->second->gid != lhs->second->gid ||
-                     memcmp(lhs->second->data, rhs->second->data, lhs->second->filesize) != 0;
+                     (!clean.count(lhs->second) &&
+                      memcmp(lhs->second->data, rhs->second->data, lhs->second->filesize) != 0);
         } // smh is added
 
         if (is_new) {
+            modified();
             fprintf(stderr, "%s entry [%s] (%04o)\n", res > 0 ? "Add new" : "Updated", lhs->first.data(), lhs->second->mode & 0777);
-            insert(lhs->first, lhs->second.release());
+            if (res == 0 && clean.count(lhs->second)) {
+                // Only the metadata changed, the content was never read
+                rhs->second->mode = lhs->second->mode;
+                rhs->second->uid = lhs->second->uid;
+                rhs->second->gid = lhs->second->gid;
+            } else if (res == 0) {
+                rhs->second->free_data();
+                rhs->second = lhs->second;
+            } else {
+                // Insertion keeps rhs pointing at the same entry
+                rhs = entries.emplace(rhs, lhs->first, lhs->second) + 1;
+            }
         }
 
         if (res > 0) {
@@ -243,12 +960,17 @@ void cpio::load_cpio(const char* dir, const char* config, bool sync) {
             ++lhs; ++rhs;
         }
     }
+
+#if !defined(SVB_WIN32) && !defined(SVB_MINGW)
+    // The tree matches the archive that is going to be dumped, dump() records it
+    write_state(state_file.data(), states);
+    pending_state = state_file;
+#endif
 }
 
 bool cpio::extract(const char *name, const char *file) {
-    auto it = entries.find(name);
-    if (it != entries.end()) {
-        extract_entry(*it, file);
+    if (auto e = get(name)) {
+        extract_entry({ name, e }, file);
         return true;
     }
     fprintf(stderr, "Cannot find the file entry [%s]\n", name);
@@ -256,67 +978,441 @@ bool cpio::extract(const char *name, const char *file) {
 }
 
 bool cpio::exists(const char *name) {
-    return entries.count(name) != 0;
+    if (lazy_fd >= 0)
+        return lookup(name) != nullptr;
+    return find(name) != entries.end();
+}
+
+static bool same_entry(const cpio_entry *a, const cpio_entry *b) {
+    return a->mode == b->mode && a->uid == b->uid && a->gid == b->gid &&
+           a->filesize == b->filesize && memcmp(a->data, b->data, a->filesize) == 0;
+}
+
+bool cpio::equals(cpio &o) {
+    load_entries();
+    o.load_entries();
+    return entries.size() == o.entries.size() &&
+           equal(entries.begin(), entries.end(), o.entries.begin(), [](auto &a, auto &b) {
+               return a.first == b.first && same_entry(a.second, b.second);
+           });
+}
+
+bool cpio::dump_overlay(cpio &base, stream &out, FILE *log) {
+    load_entries();
+    base.load_entries();
+    // Only a table, names and entries stay owned by our arena
+    cpio delta;
+    delta.dedup = dedup;
+    delta.reorder = reorder;
+
+    auto lhs = base.entries.begin();
+    auto rhs = entries.begin();
+    while (lhs != base.entries.end() || rhs != entries.end()) {
+        int res;
+        if (lhs == base.entries.end()) {
+            res = 1;
+        } else if (rhs == entries.end()) {
+            res = -1;
+        } else {
+            res = lhs->first.compare(rhs->first);
+        }
+        if (res < 0) {
+            fprintf(log, "Removed entry [%s] cannot be overlaid\n", lhs->first.data());
+            return false;
+        }
+        if (res > 0 || !same_entry(lhs->second, rhs->second)) {
+            fprintf(log, "Overlay entry [%s]\n", rhs->first.data());
+            delta.entries.push_back(*rhs);
+        }
+        if (res == 0)
+            ++lhs;
+        ++rhs;
+    }
+    delta.dump(out);
+    return true;
+}
+
+// Rough content classes, similar files compress better next to each other
+enum {
+    CLASS_SPECIAL,
+    CLASS_TEXT,
+    CLASS_DATA,
+    CLASS_SEPOLICY,
+    CLASS_ELF,
+};
+
+#define SEPOLICY_MAGIC "\x8c\xff\x7c\xf9"
+
+static int content_class(string_view name, const cpio_entry *e) {
+    if (!S_ISREG(e->mode))
+        return CLASS_SPECIAL;
+    string_view data(static_cast<const char *>(e->data), e->filesize);
+    if (str_starts(data, "\x7f" "ELF"))
+        return CLASS_ELF;
+    if (str_starts(data, SEPOLICY_MAGIC) || str_ends(name, "sepolicy"))
+        return CLASS_SEPOLICY;
+    // Anything without control characters in its first bytes is considered text
+    for (unsigned char c : data.substr(0, 512)) {
+        if (c < 0x20 && c != '\n' && c != '\r' && c != '\t')
+            return CLASS_DATA;
+    }
+    return CLASS_TEXT;
 }
 
-#define do_out(buf, len) pos += fwrite(buf, 1, len, out);
-#define out_align() do_out(zeros, align_padding(pos, 4))
-void cpio::dump(FILE *out) {
+static string_view extension(string_view name) {
+    auto base = name.substr(name.rfind('/') + 1);
+    auto dot = base.rfind('.');
+    return dot == string_view::npos ? string_view() : base.substr(dot + 1);
+}
+
+// Archive order of all entries. By default entries are sorted by name. With cluster,
+// every directory comes first, still sorted so parents precede their children as the
+// kernel unpacker requires, followed by everything else clustered by content class,
+// extension and base name.
+vector<size_t> cpio::dump_order(bool cluster) {
+    vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    if (!cluster)
+        return order;
+
+    auto dirs_end = stable_partition(order.begin(), order.end(), [&](size_t i) {
+        return S_ISDIR(entries[i].second->mode);
+    });
+    vector<int> cls(entries.size());
+    for (auto it = dirs_end; it != order.end(); ++it)
+        cls[*it] = content_class(entries[*it].first, entries[*it].second);
+    stable_sort(dirs_end, order.end(), [&](size_t a, size_t b) {
+        auto &na = entries[a].first;
+        auto &nb = entries[b].first;
+        return make_tuple(cls[a], extension(na), na.substr(na.rfind('/') + 1)) <
+               make_tuple(cls[b], extension(nb), nb.substr(nb.rfind('/') + 1));
+    });
+    return order;
+}
+
+// Decide the layout of every entry, in archive order. Entries written as hardlinks
+// of each other must be regular files with identical attributes and content, they
+// share one inode and only the last member carries the data, same as gen_init_cpio
+// and GNU cpio.
+vector<cpio::dump_slot> cpio::plan_dump(bool cluster) {
+    auto order = dump_order(cluster);
+    vector<size_t> pos(entries.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        pos[order[i]] = i;
+
+    vector<size_t> cand;
+    for (size_t i : order) {
+        auto e = entries[i].second;
+        if (S_ISREG(e->mode) && e->filesize && (dedup || e->link))
+            cand.push_back(i);
+    }
+    vector<uint64_t> hash(cand.size());
+    parallel_for(cand.size(), [&](size_t i) {
+        auto e = entries[cand[i]].second;
+        hash[i] = XXH64(e->data, e->filesize, 0);
+    });
+
+    // Bucket by everything cheap to compare, then split buckets by actual content
+    using key_t = tuple<uint32_t, uint32_t, uint64_t, uint32_t, uint32_t, uint32_t>;
+    map<key_t, vector<vector<size_t>>> buckets;
+    for (size_t i = 0; i < cand.size(); ++i) {
+        auto e = entries[cand[i]].second;
+        auto &groups = buckets[{ dedup ? 0 : e->link, e->filesize, hash[i], e->mode, e->uid, e->gid }];
+        auto g = find_if(groups.begin(), groups.end(), [&](const vector<size_t> &g) {
+            return memcmp(entries[g[0]].second->data, e->data, e->filesize) == 0;
+        });
+        if (g == groups.end())
+            groups.emplace_back(1, cand[i]);
+        else
+            g->push_back(cand[i]);
+    }
+
+    // Groups are built in archive order, the leader is written first
+    vector<dump_slot> plan(order.size());
+    vector<size_t> leader(entries.size(), SIZE_MAX);
+    for (auto &b : buckets) {
+        for (auto &g : b.second) {
+            if (g.size() < 2)
+                continue;
+            for (size_t i : g) {
+                leader[i] = g[0];
+                plan[pos[i]] = { i, 0, (uint32_t) g.size(), i == g.back() };
+            }
+        }
+    }
+
+    unsigned inode = 300000;
+    for (size_t n = 0; n < order.size(); ++n) {
+        size_t i = order[n];
+        if (leader[i] == SIZE_MAX)
+            plan[n] = { i, inode++, 1, true };
+        else if (leader[i] == i)
+            plan[n].ino = inode++;
+        else
+            plan[n].ino = plan[pos[leader[i]]].ino;
+    }
+    return plan;
+}
+
+size_t cpio::dump_size() {
+    load_entries();
+    return dump_size(plan_dump(reorder));
+}
+
+size_t cpio::dump_size(const vector<dump_slot> &plan) {
+    size_t sz = 0;
+    for (auto &slot : plan) {
+        auto &e = entries[slot.idx];
+        sz = align_to(sz + sizeof(cpio_newc_header) + e.first.size() + 1, 4);
+        if (slot.data)
+            sz = align_to(sz + e.second->filesize, 4);
+    }
+    return align_to(sz + sizeof(cpio_newc_header) + 11, 4);
+}
+
+// writev is allowed to stop short, keep going until everything is out
+static void write_iov(stream &out, iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t ret = out.writev(iov, iovcnt);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            PLOGE("Dump cpio");
+        }
+        for (; iovcnt > 0 && (size_t) ret >= iov->iov_len; ++iov, --iovcnt)
+            ret -= iov->iov_len;
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+// Number of entries gathered into a single writev call, each one needs at most
+// 5 iovecs: header, name, padding, data, padding
+#define DUMP_BATCH 128
+
+void cpio::dump(stream &out) {
+    load_entries();
+    dump(out, plan_dump(reorder));
+}
+
+void cpio::dump(stream &out, const vector<dump_slot> &plan) {
+    static const char zeros[4] = {0};
+    cpio_newc_header headers[DUMP_BATCH];
+    iovec iov[DUMP_BATCH * 5];
+    int iovcnt = 0;
+    int n = 0;
     size_t pos = 0;
+
+    auto add = [&](const void *buf, size_t len) {
+        iov[iovcnt++] = { const_cast<void *>(buf), len };
+        pos += len;
+    };
+    auto pad = [&] {
+        if (size_t len = align_padding(pos, 4))
+            add(zeros, len);
+    };
+    auto flush = [&] {
+        write_iov(out, iov, iovcnt);
+        iovcnt = 0;
+        n = 0;
+    };
+
+    // Only ino, mode, uid, gid, nlink, filesize and namesize vary between entries
+    uint32_t f[NEWC_FIELDS] = {};
     unsigned inode = 300000;
-    char header[111];
-    char zeros[4] = {0};
-    for (auto &e : entries) {
-        sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
-                inode++,    // e->ino
-                e.second->mode,
-                e.second->uid,
-                e.second->gid,
-                1,          // e->nlink
-                0,          // e->mtime
-                e.second->filesize,
-                0,          // e->devmajor
-                0,          // e->devminor
-                0,          // e->rdevmajor
-                0,          // e->rdevminor
-                (uint32_t) e.first.size() + 1,
-                0           // e->check
-        );
-        do_out(header, 110);
-        do_out(e.first.data(), e.first.size() + 1);
-        out_align();
-        if (e.second->filesize) {
-            do_out(e.second->data, e.second->filesize);
-            out_align();
+    for (auto &slot : plan) {
+        auto &e = entries[slot.idx];
+        f[NEWC_INO] = slot.ino;
+        f[NEWC_MODE] = e.second->mode;
+        f[NEWC_UID] = e.second->uid;
+        f[NEWC_GID] = e.second->gid;
+        f[NEWC_NLINK] = slot.nlink;
+        f[NEWC_FILESIZE] = slot.data ? e.second->filesize : 0;
+        f[NEWC_NAMESIZE] = e.first.size() + 1;
+        newc_encode(f, &headers[n]);
+        add(&headers[n++], sizeof(cpio_newc_header));
+        add(e.first.data(), e.first.size() + 1);
+        pad();
+        inode = std::max(inode, slot.ino + 1);
+        if (f[NEWC_FILESIZE]) {
+            add(e.second->data, e.second->filesize);
+            pad();
         }
+        if (n == DUMP_BATCH)
+            flush();
     }
     // Write trailer
-    sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
-            inode++, 0755, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0);
-    do_out(header, 110);
-    do_out("TRAILER!!!\0", 11);
-    out_align();
-    fclose(out);
+    f[NEWC_INO] = inode++;
+    f[NEWC_MODE] = 0755;
+    f[NEWC_NLINK] = 1;
+    f[NEWC_UID] = f[NEWC_GID] = f[NEWC_FILESIZE] = 0;
+    f[NEWC_NAMESIZE] = 11;
+    newc_encode(f, &headers[n]);
+    add(&headers[n++], sizeof(cpio_newc_header));
+    add("TRAILER!!!\0", 11);
+    pad();
+    flush();
+}
+
+// Reads parts of an archive file through a small buffer, so walking the headers
+// skips the entry data instead of reading the whole file
+class cpio_window {
+public:
+    cpio_window(int fd, size_t sz) : fd(fd), sz(sz), buf(WINDOW_SZ) {}
+
+    // Bytes [off, off + n) of the file, nullptr if they are not all there
+    const char *at(size_t off, size_t n) {
+        if (off > sz || sz - off < n)
+            return nullptr;
+        if (off < start || off + n > start + len) {
+            if (n > buf.size())
+                buf.resize(n);
+            len = std::min(buf.size(), sz - off);
+            start = off;
+            if (!read(off, buf.data(), len)) {
+                len = 0;
+                return nullptr;
+            }
+        }
+        return buf.data() + (off - start);
+    }
+
+    // Offset of the first magic of scanner at or after off, sz if there is none.
+    // None of the magics may be longer than magic_len.
+    size_t find(size_t off, const magic_scanner &scanner, size_t magic_len) {
+        while (off < sz) {
+            size_t n = std::min(buf.size(), sz - off);
+            auto p = at(off, n);
+            if (p == nullptr)
+                break;
+            if (size_t hit = scanner.find(p, n); hit != n)
+                return off + hit;
+            if (off + n == sz || n < magic_len)
+                break;
+            off += n - (magic_len - 1);
+        }
+        return sz;
+    }
+
+    bool read(size_t off, void *out, size_t n) {
+        return lseek(fd, off, SEEK_SET) == (off_t) off && xxread(fd, out, n) == (ssize_t) n;
+    }
+
+private:
+    static constexpr size_t WINDOW_SZ = 16 * 1024;
+
+    int fd;
+    size_t sz;
+    vector<char> buf;
+    size_t start = 0;
+    size_t len = 0;
+};
+
+cpio::~cpio() {
+    if (lazy_fd >= 0)
+        close(lazy_fd);
+    for (auto &a : archives) {
+        if (a.buf)
+            munmap(a.buf, a.sz);
+    }
 }
 
 void cpio::load_cpio(const char *file) {
     fprintf(stderr, "Loading cpio: [%s]\n", file);
-    auto m = mmap_data(file);
-    load_cpio(reinterpret_cast<char *>(m.buf), m.sz);
+    // Merging into loaded entries needs the whole table of both
+    bool merge = lazy_fd >= 0 || !entries.empty();
+    load_entries();
+    lazy_fd = xopen(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    fstat(lazy_fd, &st);
+    lazy_sz = st.st_size;
+    // Otherwise only the headers are read here, the entry table is built once it is used
+    if (merge)
+        load_entries();
+    else
+        load_index();
+    origin = file;
+}
+
+void cpio::load_entries() {
+    if (lazy_fd < 0)
+        return;
+    struct stat st;
+    fstat(lazy_fd, &st);
+    // Entries keep pointing into this private mapping so data is read on first access,
+    // and patching in place is copy on write
+    void *buf = lazy_sz ? xmmap(nullptr, lazy_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE, lazy_fd, 0) : nullptr;
+    close(lazy_fd);
+    lazy_fd = -1;
+    index.clear();
+    index.shrink_to_fit();
+    archives.push_back({ st.st_dev, st.st_ino, buf, lazy_sz });
+    // Inserting marks the entries as modified, they still match the archive
+    string file = std::move(origin);
+    load_cpio(static_cast<char *>(buf), lazy_sz);
+    origin = std::move(file);
+}
+
+const cpio::index_entry *cpio::lookup(string_view name) {
+    auto it = lower_bound(index.begin(), index.end(), name,
+                          [](const index_entry &e, string_view n) { return e.name < n; });
+    if (it != index.end() && it->name == name)
+        return &*it;
+    return nullptr;
+}
+
+cpio_entry *cpio::get(string_view name) {
+    if (lazy_fd < 0) {
+        auto it = find(name);
+        return it == entries.end() ? nullptr : it->second;
+    }
+    auto idx = lookup(name);
+    if (idx == nullptr)
+        return nullptr;
+    cpio_window w(lazy_fd, lazy_sz);
+    uint32_t f[NEWC_FIELDS];
+    auto hdr = reinterpret_cast<const cpio_newc_header *>(w.at(idx->offset, sizeof(cpio_newc_header)));
+    if (hdr == nullptr || !newc_decode(hdr, f)) {
+        errno = EINVAL;
+        LOGE("bad cpio header\n");
+    }
+    if (S_ISREG(f[NEWC_MODE]) && f[NEWC_NLINK] > 1 && f[NEWC_FILESIZE] == 0) {
+        // The data is carried by another member of the hardlink group
+        load_entries();
+        return find(name)->second;
+    }
+    auto e = arena.entry(f[NEWC_MODE], f[NEWC_UID], f[NEWC_GID]);
+    e->filesize = f[NEWC_FILESIZE];
+    e->data = xmalloc(e->filesize);
+    size_t pos = align_to(idx->offset + sizeof(cpio_newc_header) + f[NEWC_NAMESIZE], 4);
+    if (!w.read(pos, e->data, e->filesize)) {
+        errno = EINVAL;
+        LOGE("bad cpio entry [%.*s]\n", (int) name.size(), name.data());
+    }
+    return e;
 }
 
 void cpio::insert(string_view name, cpio_entry *e) {
-    auto it = entries.find(name);
-    if (it != entries.end()) {
-        it->second.reset(e);
+    modified();
+    // Archives are usually sorted already, check the tail first
+    auto it = entries.end();
+    if (!entries.empty() && entries.back().first >= name)
+        it = lower_bound(entries.begin(), entries.end(), name, entry_cmp);
+    if (it != entries.end() && it->first == name) {
+        it->second->free_data();
+        it->second = e;
     } else {
-        entries.emplace(name, e);
+        entries.emplace(it, arena.str(name), e);
     }
 }
 
 void cpio::add(mode_t mode, const char *name, const char *file) {
+    load_entries();
     auto m = mmap_data(file);
-    auto e = new cpio_entry(S_IFREG | mode);
+    auto e = arena.entry(S_IFREG | mode);
     e->filesize = m.sz;
     e->data = xmalloc(m.sz);
     memcpy(e->data, m.buf, m.sz);
@@ -325,12 +1421,14 @@ void cpio::add(mode_t mode, const char *name, const char *file) {
 }
 
 void cpio::mkdir(mode_t mode, const char *name) {
-    insert(name, new cpio_entry(S_IFDIR | mode));
+    load_entries();
+    insert(name, arena.entry(S_IFDIR | mode));
     fprintf(stderr, "Create directory [%s] (%04o)\n", name, mode);
 }
 
 void cpio::ln(const char *target, const char *name) {
-    auto e = new cpio_entry(S_IFLNK);
+    load_entries();
+    auto e = arena.entry(S_IFLNK);
     e->filesize = strlen(target);
     e->data = strdup(target);
     insert(name, e);
@@ -339,13 +1437,14 @@ void cpio::ln(const char *target, const char *name) {
 
 void cpio::mv(entry_map::iterator it, const char *name) {
     fprintf(stderr, "Move [%s] -> [%s]\n", it->first.data(), name);
-    auto e = it->second.release();
+    auto e = it->second;
     entries.erase(it);
     insert(name, e);
 }
 
 bool cpio::mv(const char *from, const char *to) {
-    auto it = entries.find(from);
+    load_entries();
+    auto it = find(from);
     if (it != entries.end()) {
         mv(it, to);
         return true;
@@ -354,34 +1453,210 @@ bool cpio::mv(const char *from, const char *to) {
     return false;
 }
 
+void cpio::batch(const vector<batch_op> &ops) {
+    if (ops.empty())
+        return;
+    load_entries();
+    modified();
+
+    // Work on a view of the table: entries that are gone are only flagged and
+    // entries under a new name are kept aside, everything is merged back at the end
+    vector<bool> gone(entries.size());
+    map<string_view, cpio_entry *> moved;
+
+    // Take a live entry out of the view, nullptr if there is none
+    auto take = [&](string_view name) -> cpio_entry * {
+        if (auto m = moved.find(name); m != moved.end()) {
+            auto e = m->second;
+            moved.erase(m);
+            return e;
+        }
+        auto it = find(name);
+        if (it == entries.end() || gone[it - entries.begin()])
+            return nullptr;
+        gone[it - entries.begin()] = true;
+        return it->second;
+    };
+
+    for (auto &op : ops) {
+        if (!op.to.empty()) {
+            auto e = take(op.from);
+            if (e == nullptr) {
+                fprintf(stderr, "Cannot find entry %s\n", op.from.data());
+                continue;
+            }
+            fprintf(stderr, "Move [%s] -> [%s]\n", op.from.data(), op.to.data());
+            if (auto old = take(op.to))
+                old->free_data();
+            moved[arena.str(op.to)] = e;
+            continue;
+        }
+
+        if (auto e = take(op.from)) {
+            fprintf(stderr, "Remove [%s]\n", op.from.data());
+            e->free_data();
+        }
+        if (!op.r)
+            continue;
+        string prefix = op.from + '/';
+        auto it = lower_bound(entries.begin(), entries.end(), prefix, entry_cmp);
+        for (; it != entries.end() && str_starts(it->first, prefix); ++it) {
+            if (gone[it - entries.begin()])
+                continue;
+            gone[it - entries.begin()] = true;
+            fprintf(stderr, "Remove [%s]\n", it->first.data());
+            it->second->free_data();
+        }
+        for (auto m = moved.lower_bound(prefix); m != moved.end() && str_starts(m->first, prefix);) {
+            fprintf(stderr, "Remove [%s]\n", m->first.data());
+            m->second->free_data();
+            m = moved.erase(m);
+        }
+    }
+
+    entry_map merged;
+    merged.reserve(entries.size() + moved.size());
+    auto m = moved.begin();
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (gone[i])
+            continue;
+        for (; m != moved.end() && m->first < entries[i].first; ++m)
+            merged.emplace_back(*m);
+        merged.push_back(entries[i]);
+    }
+    merged.insert(merged.end(), m, moved.end());
+    entries.swap(merged);
+}
+
 #define pos_align(p) p = align_to(p, 4)
 
+void cpio::load_index() {
+    cpio_window w(lazy_fd, lazy_sz);
+    size_t pos = 0;
+    uint32_t f[NEWC_FIELDS];
+    while (pos < lazy_sz) {
+        size_t offset = pos;
+        auto hdr = reinterpret_cast<const cpio_newc_header *>(w.at(pos, sizeof(cpio_newc_header)));
+        if (hdr == nullptr || !newc_decode(hdr, f) || f[NEWC_NAMESIZE] == 0) {
+            errno = EINVAL;
+            LOGE("bad cpio header\n");
+        }
+        pos += sizeof(cpio_newc_header);
+        auto p = w.at(pos, f[NEWC_NAMESIZE]);
+        string_view name(p, f[NEWC_NAMESIZE] - 1);
+        if (p == nullptr || p[name.size()] != '\0' || memchr(name.data(), '\0', name.size())) {
+            errno = EINVAL;
+            LOGE("bad cpio header\n");
+        }
+        pos += f[NEWC_NAMESIZE];
+        pos_align(pos);
+        if (name == "." || name == "..")
+            continue;
+        if (name == "TRAILER!!!") {
+            // Android support multiple CPIO being concatenated
+            // Search for the next cpio header
+            if (pos >= lazy_sz)
+                break;
+            static const magic_scanner scanner { MAGIC(NEWC_MAGIC) };
+            pos = w.find(pos, scanner, sizeof(NEWC_MAGIC) - 1);
+            continue;
+        }
+        if (pos > lazy_sz || lazy_sz - pos < f[NEWC_FILESIZE]) {
+            errno = EINVAL;
+            LOGE("bad cpio entry [%.*s]\n", (int) name.size(), name.data());
+        }
+        index.push_back({ arena.str(name), offset, f[NEWC_FILESIZE], f[NEWC_MODE] });
+        pos += f[NEWC_FILESIZE];
+        pos_align(pos);
+    }
+
+    // Later entries replace earlier ones with the same name
+    stable_sort(index.begin(), index.end(),
+                [](const index_entry &a, const index_entry &b) { return a.name < b.name; });
+    auto last = index.begin();
+    for (auto it = index.begin(); it != index.end(); ++it) {
+        if (last != index.begin() && (last - 1)->name == it->name)
+            *(last - 1) = *it;
+        else
+            *last++ = *it;
+    }
+    index.erase(last, index.end());
+}
+
 void cpio::load_cpio(const char *buf, size_t sz) {
+    load_entries();
     size_t pos = 0;
+    uint32_t f[NEWC_FIELDS];
+    // Hardlinks are identified by inode and device within one concatenated archive
+    map<tuple<int, uint32_t, uint32_t, uint32_t>, uint32_t> links;
+    int segment = 0;
     while (pos < sz) {
         auto hdr = reinterpret_cast<const cpio_newc_header *>(buf + pos);
-        if (memcmp(hdr->magic, "070701", 6) != 0)
+        // Reject anything that does not fit, or a name that is not a single C string
+        if (sz - pos < sizeof(cpio_newc_header) || !newc_decode(hdr, f) ||
+            f[NEWC_NAMESIZE] == 0 ||
+            sz - pos - sizeof(cpio_newc_header) < f[NEWC_NAMESIZE]) {
+            errno = EINVAL;
             LOGE("bad cpio header\n");
+        }
         pos += sizeof(cpio_newc_header);
-        string_view name(buf + pos);
-        pos += x8u(hdr->namesize);
+        string_view name(buf + pos, f[NEWC_NAMESIZE] - 1);
+        if (buf[pos + name.size()] != '\0' || memchr(name.data(), '\0', name.size())) {
+            errno = EINVAL;
+            LOGE("bad cpio header\n");
+        }
+        pos += f[NEWC_NAMESIZE];
         pos_align(pos);
         if (name == "." || name == "..")
             continue;
         if (name == "TRAILER!!!") {
             // Android support multiple CPIO being concatenated
             // Search for the next cpio header
-            auto next = static_cast<const char *>(memmem(buf + pos, sz - pos, "070701", 6));
-            if (next == nullptr)
+            if (pos >= sz)
                 break;
-            pos = next - buf;
+            static const magic_scanner scanner { MAGIC("070701") };
+            pos = scanner.find(buf, sz, pos);
+            if (pos == sz)
+                break;
+            ++segment;
             continue;
         }
-        auto entry = new cpio_entry(hdr);
-        entry->data = xmalloc(entry->filesize);
-        memcpy(entry->data, buf + pos, entry->filesize);
+        if (pos > sz || sz - pos < f[NEWC_FILESIZE]) {
+            errno = EINVAL;
+            LOGE("bad cpio entry [%.*s]\n", (int) name.size(), name.data());
+        }
+        auto entry = arena.entry(f[NEWC_MODE], f[NEWC_UID], f[NEWC_GID]);
+        entry->filesize = f[NEWC_FILESIZE];
+        entry->data = const_cast<char *>(buf + pos);
+        entry->borrowed = true;
+        if (S_ISREG(entry->mode) && f[NEWC_NLINK] > 1) {
+            auto &link = links[{ segment, f[NEWC_INO], f[NEWC_DEVMAJOR], f[NEWC_DEVMINOR] }];
+            if (!link)
+                link = next_link++;
+            entry->link = link;
+        }
         pos += entry->filesize;
         insert(name, entry);
         pos_align(pos);
     }
+
+    if (links.empty())
+        return;
+    // Only one member of a hardlink group carries the data, give everyone a copy
+    unordered_map<uint32_t, const cpio_entry *> holders;
+    for (auto &e : entries) {
+        if (e.second->link && e.second->filesize)
+            holders[e.second->link] = e.second;
+    }
+    for (auto &e : entries) {
+        if (!e.second->link || e.second->filesize)
+            continue;
+        auto it = holders.find(e.second->link);
+        if (it == holders.end())
+            continue;
+        e.second->free_data();
+        e.second->filesize = it->second->filesize;
+        e.second->data = xmalloc(e.second->filesize);
+        memcpy(e.second->data, it->second->data, e.second->filesize);
+    }
 }
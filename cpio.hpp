@@ -1,12 +1,15 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
 #include <string>
 #include <memory>
-#include <map>
+#include <vector>
+#include <new>
 #include <string_view>
 
-struct cpio_newc_header;
+class stream;
 
 struct cpio_entry {
     uint32_t mode;
@@ -14,26 +17,104 @@ struct cpio_entry {
     uint32_t gid;
     uint32_t filesize;
     void *data;
+    // Length of the private file mapping holding data, 0 if data is on the heap
+    size_t map_sz;
+    // Hardlink group, 0 if not linked
+    uint32_t link;
+    // Data points into the archive mapping of the cpio this entry was loaded into
+    bool borrowed;
 
     explicit cpio_entry(uint32_t mode = 0);
     explicit cpio_entry(uint32_t mode, uint32_t uid, uint32_t gid);
-    explicit cpio_entry(const cpio_newc_header *h);
-    ~cpio_entry() { free(data); }
+    cpio_entry(cpio_entry &&e);
+    cpio_entry(const cpio_entry &) = delete;
+    ~cpio_entry() { free_data(); }
+
+    void free_data();
+    void materialize();
+};
+
+// Backing store for entry names and cpio_entry structs.
+// Names are packed into large blocks and entries into fixed size slabs,
+// all of them released together when the arena is destroyed.
+class cpio_arena {
+public:
+    cpio_arena() = default;
+    cpio_arena(const cpio_arena &) = delete;
+
+    // Copy s into the arena, the result is always null terminated
+    std::string_view str(std::string_view s);
+
+    template <class ...Args>
+    cpio_entry *entry(Args &&...args) {
+        cpio_entry *e = next_entry();
+        e->~cpio_entry();
+        return new (e) cpio_entry(std::forward<Args>(args)...);
+    }
+
+private:
+    static constexpr size_t BLOCK_SZ = 64 * 1024;
+    static constexpr size_t SLAB_SZ = 1024;
+
+    cpio_entry *next_entry();
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<std::unique_ptr<cpio_entry[]>> slabs;
+    char *cur = nullptr;
+    size_t avail = 0;
+    size_t slab_used = SLAB_SZ;
 };
 
 class cpio {
 public:
-    struct StringCmp {
-        using is_transparent = void;
-        bool operator()(std::string_view a, std::string_view b) const {
-            return a < b;
-        }
+    // Names and entries are owned by the arena, the table is kept sorted by name
+    using entry_t = std::pair<std::string_view, cpio_entry *>;
+    using entry_map = std::vector<entry_t>;
+
+    // Archive loaded from a file, entries borrow their data from its mapping
+    struct archive_map {
+        dev_t dev;
+        ino_t ino;
+        void *buf;
+        size_t sz;
+    };
+
+    // Header of an archive entry that was only indexed, offset points to the header
+    struct index_entry {
+        std::string_view name;
+        uint64_t offset;
+        uint32_t size;
+        uint32_t mode;
     };
-    using entry_map = std::map<std::string, std::unique_ptr<cpio_entry>, StringCmp>;
+
+    // Source file of an entry whose data is mapped
+    struct mapped_file {
+        dev_t dev;
+        ino_t ino;
+        cpio_entry *e;
+    };
+
+    // A removal when to is empty, a move otherwise
+    struct batch_op {
+        std::string from;
+        std::string to;
+        bool r = false;
+    };
+
+    // Store regular files with identical content and attributes once, as hardlinks
+    bool dedup = false;
+    // Cluster similar entries in the archive instead of sorting them by name
+    bool reorder = false;
+
+    ~cpio();
 
     void load_cpio(const char *file);
     void load_cpio(const char* dir, const char* config, bool sync);
+    // Entries borrow their data from buf, which has to outlive the cpio
+    void load_cpio(const char *buf, size_t sz);
     void dump(const char *file);
+    void dump(stream &out);
+    size_t dump_size();
     void rm(const char *name, bool r = false);
     void extract();
     bool extract(const char *name, const char *file);
@@ -42,16 +123,54 @@ public:
     void mkdir(mode_t mode, const char *name);
     void ln(const char *target, const char *name);
     bool mv(const char *from, const char *to);
+    // Apply removals and moves in order, with a single pass over the table
+    void batch(const std::vector<batch_op> &ops);
+    // Dump only the entries that are new or changed compared to base, to be appended
+    // after it. Fails if entries of base were removed, an appended archive cannot do that.
+    bool dump_overlay(cpio &base, stream &out, FILE *log = stderr);
+    bool equals(cpio &o);
 
 protected:
+    cpio_arena arena;
     entry_map entries;
+    std::vector<mapped_file> mapped;
+    std::vector<archive_map> archives;
+    // Archive that was only indexed so far, sorted by name, -1 once the entries are built
+    int lazy_fd = -1;
+    size_t lazy_sz = 0;
+    std::vector<index_entry> index;
+    // Archive file the entries were loaded from, empty once they were changed
+    std::string origin;
+    // Sync state written without an archive yet, completed by the next dump
+    std::string pending_state;
 
-    static void extract_entry(const entry_map::value_type &e, const char *file);
-    void rm(entry_map::iterator it);
+    // Call before changing the entries in any way
+    void modified() { origin.clear(); pending_state.clear(); }
+    entry_map::iterator find(std::string_view name);
+    static void extract_entry(const entry_t &e, const char *file);
+    entry_map::iterator rm(entry_map::iterator it);
     void mv(entry_map::iterator it, const char *name);
+    void insert(std::string_view name, cpio_entry *e);
+    // Call before using the entry table, builds it for an archive that was only indexed
+    void load_entries();
+    // Single entry read on its own, nullptr if there is none
+    cpio_entry *get(std::string_view name);
 
 private:
-    void dump(FILE *out);
-    void insert(std::string_view name, cpio_entry *e);
-    void load_cpio(const char *buf, size_t sz);
+    friend class lz4_size_stream;
+
+    // Archive layout of one entry
+    struct dump_slot {
+        size_t idx;
+        uint32_t ino;
+        uint32_t nlink;
+        bool data;
+    };
+
+    std::vector<size_t> dump_order(bool cluster);
+    std::vector<dump_slot> plan_dump(bool cluster);
+    size_t dump_size(const std::vector<dump_slot> &plan);
+    void dump(stream &out, const std::vector<dump_slot> &plan);
+    void load_index();
+    const index_entry *lookup(std::string_view name);
 };
@@ -11,6 +11,7 @@
 #include "magiskboot.hpp"
 #include "dtb.hpp"
 #include "format.hpp"
+#include "scan.hpp"
 
 using namespace std;
 
@@ -96,16 +97,15 @@ static int find_fstab(const void *fdt, int node = 0) {
     return -1;
 }
 
+static const magic_scanner dtb_scanner { MAGIC(DTB_MAGIC) };
+
 template<typename Func>
 static void for_each_fdt(const char *file, bool rw, Func fn) {
     auto m = mmap_data(file, rw);
-    uint8_t *end = m.buf + m.sz;
-    for (uint8_t *fdt = m.buf; fdt < end;) {
-        fdt = static_cast<uint8_t*>(memmem(fdt, end - fdt, DTB_MAGIC, sizeof(fdt32_t)));
-        if (fdt == nullptr)
-            break;
+    for (size_t off = 0; (off = dtb_scanner.find(m.buf, m.sz, off)) < m.sz;) {
+        uint8_t *fdt = m.buf + off;
         fn(fdt);
-        fdt += fdt_totalsize(fdt);
+        off += fdt_totalsize(fdt);
     }
 }
 
@@ -342,11 +342,8 @@ static bool blob_patch(uint8_t *dtb, size_t dtb_sz, const char *out) {
     vector<uint8_t *> fdt_list;
     vector<uint32_t> padding_list;
 
-    uint8_t * const end = dtb + dtb_sz;
-    for (uint8_t *curr = dtb; curr < end;) {
-        curr = static_cast<uint8_t*>(memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt32_t)));
-        if (curr == nullptr)
-            break;
+    for (size_t off = 0; (off = dtb_scanner.find(dtb, dtb_sz, off)) < dtb_sz;) {
+        uint8_t *curr = dtb + off;
         auto len = fdt_totalsize(curr);
         auto fdt = static_cast<uint8_t *>(xmalloc(len + MAX_FDT_GROWTH));
         memcpy(fdt, curr, len);
@@ -355,7 +352,7 @@ static bool blob_patch(uint8_t *dtb, size_t dtb_sz, const char *out) {
         padding_list.push_back(padding);
         fdt_open_into(fdt, fdt, len + MAX_FDT_GROWTH);
         fdt_list.push_back(fdt);
-        curr += len;
+        off += len;
     }
 
     bool modified = false;
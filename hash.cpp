@@ -0,0 +1,404 @@
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#include <zlib.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA_X86
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+#include <arm_neon.h>
+#define SHA_ARM
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC_ARM
+#endif
+
+#include "hash.hpp"
+
+using namespace std;
+
+// Compress n consecutive 64 byte blocks into state
+using transform_t = void (*)(uint32_t *state, const uint8_t *data, size_t n);
+
+#if defined(SHA_X86) || defined(SHA_ARM)
+
+alignas(16) static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+#endif
+
+#if defined(SHA_X86)
+
+#define SHA_TARGET __attribute__((target("sha,sse4.1")))
+
+// Message words are big endian
+#define LOAD_BE32(p) _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), \
+        _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL))
+
+SHA_TARGET static void sha1_blocks(uint32_t *state, const uint8_t *data, size_t n) {
+    const __m128i reverse = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; n; --n, data += 64) {
+        __m128i abcd_save = abcd;
+        __m128i e0_save = e0;
+        __m128i w[4];
+        __m128i prev = abcd, e;
+#pragma GCC unroll 20
+        for (int g = 0; g < 20; ++g) {
+            // Message schedule, 4 words at a time
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + g * 16)), reverse);
+            } else {
+                __m128i m = _mm_sha1msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+                m = _mm_xor_si128(m, w[(g + 2) & 3]);
+                w[g & 3] = _mm_sha1msg2_epu32(m, w[(g + 3) & 3]);
+            }
+            e = g == 0 ? _mm_add_epi32(e0, w[0]) : _mm_sha1nexte_epu32(prev, w[g & 3]);
+            prev = abcd;
+            switch (g / 5) {
+            case 0: abcd = _mm_sha1rnds4_epu32(abcd, e, 0); break;
+            case 1: abcd = _mm_sha1rnds4_epu32(abcd, e, 1); break;
+            case 2: abcd = _mm_sha1rnds4_epu32(abcd, e, 2); break;
+            default: abcd = _mm_sha1rnds4_epu32(abcd, e, 3); break;
+            }
+        }
+        e0 = _mm_sha1nexte_epu32(prev, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+SHA_TARGET static void sha256_blocks(uint32_t *state, const uint8_t *data, size_t n) {
+    // The instructions work on the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; n; --n, data += 64) {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+        __m128i w[4];
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; ++g) {
+            if (g < 4) {
+                w[g] = LOAD_BE32(data + g * 16);
+            } else {
+                __m128i m = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+                m = _mm_add_epi32(m, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+                w[g & 3] = _mm_sha256msg2_epu32(m, w[(g + 3) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(w[g & 3], _mm_load_si128(reinterpret_cast<const __m128i *>(K256 + g * 4)));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static bool cpu_has_sha() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return false;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29));
+}
+
+#elif defined(SHA_ARM)
+
+#define LOAD_BE32(p) vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)))
+
+static void sha1_blocks(uint32_t *state, const uint8_t *data, size_t n) {
+    static const uint32_t K1[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e0 = state[4];
+
+    for (; n; --n, data += 64) {
+        uint32x4_t abcd_save = abcd;
+        uint32_t e = e0;
+        uint32x4_t w[4];
+#pragma GCC unroll 20
+        for (int g = 0; g < 20; ++g) {
+            if (g < 4) {
+                w[g] = LOAD_BE32(data + g * 16);
+            } else {
+                uint32x4_t m = vsha1su0q_u32(w[g & 3], w[(g + 1) & 3], w[(g + 2) & 3]);
+                w[g & 3] = vsha1su1q_u32(m, w[(g + 3) & 3]);
+            }
+            uint32x4_t msg = vaddq_u32(w[g & 3], vdupq_n_u32(K1[g / 5]));
+            uint32_t next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (g < 5)
+                abcd = vsha1cq_u32(abcd, e, msg);
+            else if (g >= 10 && g < 15)
+                abcd = vsha1mq_u32(abcd, e, msg);
+            else
+                abcd = vsha1pq_u32(abcd, e, msg);
+            e = next;
+        }
+        e0 += e;
+        abcd = vaddq_u32(abcd, abcd_save);
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+}
+
+static void sha256_blocks(uint32_t *state, const uint8_t *data, size_t n) {
+    uint32x4_t state0 = vld1q_u32(state);
+    uint32x4_t state1 = vld1q_u32(state + 4);
+
+    for (; n; --n, data += 64) {
+        uint32x4_t abcd_save = state0;
+        uint32x4_t efgh_save = state1;
+        uint32x4_t w[4];
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; ++g) {
+            if (g < 4) {
+                w[g] = LOAD_BE32(data + g * 16);
+            } else {
+                uint32x4_t m = vsha256su0q_u32(w[g & 3], w[(g + 1) & 3]);
+                w[g & 3] = vsha256su1q_u32(m, w[(g + 2) & 3], w[(g + 3) & 3]);
+            }
+            uint32x4_t msg = vaddq_u32(w[g & 3], vld1q_u32(K256 + g * 4));
+            uint32x4_t prev = state0;
+            state0 = vsha256hq_u32(state0, state1, msg);
+            state1 = vsha256h2q_u32(state1, prev, msg);
+        }
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+    }
+
+    vst1q_u32(state, state0);
+    vst1q_u32(state + 4, state1);
+}
+
+// Part of the target architecture the compiler was told about
+static bool cpu_has_sha() { return true; }
+
+#endif
+
+#if defined(SHA_X86) || defined(SHA_ARM)
+
+// Same buffering and padding as mincrypt, with whole blocks passed to the transform
+template <transform_t transform>
+static void update(HASH_CTX *ctx, const void *data, int len) {
+    auto p = static_cast<const uint8_t *>(data);
+    size_t used = ctx->count & 63;
+    ctx->count += len;
+    if (used) {
+        size_t n = std::min<size_t>(64 - used, len);
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        transform(ctx->state, ctx->buf, 1);
+    }
+    transform(ctx->state, p, len / 64);
+    p += len & ~63;
+    memcpy(ctx->buf, p, len & 63);
+}
+
+template <transform_t transform, int words>
+static const uint8_t *final(HASH_CTX *ctx) {
+    uint64_t bits = ctx->count * 8;
+    size_t used = ctx->count & 63;
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        transform(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (int i = 0; i < 8; ++i)
+        ctx->buf[56 + i] = bits >> ((7 - i) * 8);
+    transform(ctx->state, ctx->buf, 1);
+
+    for (int i = 0; i < words; ++i) {
+        uint32_t s = ctx->state[i];
+        ctx->buf[i * 4] = s >> 24;
+        ctx->buf[i * 4 + 1] = s >> 16;
+        ctx->buf[i * 4 + 2] = s >> 8;
+        ctx->buf[i * 4 + 3] = s;
+    }
+    return ctx->buf;
+}
+
+static void sha1_init(HASH_CTX *ctx);
+static void sha256_init(HASH_CTX *ctx);
+
+template <void (*init)(HASH_CTX *), int size>
+static const uint8_t *oneshot(const void *data, int len, uint8_t *digest) {
+    HASH_CTX ctx;
+    init(&ctx);
+    HASH_update(&ctx, data, len);
+    memcpy(digest, HASH_final(&ctx), size);
+    return digest;
+}
+
+static const HASH_VTAB SHA1_HW = {
+    sha1_init,
+    update<sha1_blocks>,
+    final<sha1_blocks, 5>,
+    oneshot<sha1_init, SHA_DIGEST_SIZE>,
+    SHA_DIGEST_SIZE
+};
+
+static const HASH_VTAB SHA256_HW = {
+    sha256_init,
+    update<sha256_blocks>,
+    final<sha256_blocks, 8>,
+    oneshot<sha256_init, SHA256_DIGEST_SIZE>,
+    SHA256_DIGEST_SIZE
+};
+
+static void sha1_init(HASH_CTX *ctx) {
+    SHA_init(ctx);
+    ctx->f = &SHA1_HW;
+}
+
+static void sha256_init(HASH_CTX *ctx) {
+    SHA256_init(ctx);
+    ctx->f = &SHA256_HW;
+}
+
+#endif
+
+void hash_init(HASH_CTX *ctx, bool sha256) {
+#if defined(SHA_X86) || defined(SHA_ARM)
+    static const bool hw = cpu_has_sha();
+    if (hw) {
+        sha256 ? sha256_init(ctx) : sha1_init(ctx);
+        return;
+    }
+#endif
+    sha256 ? SHA256_init(ctx) : SHA_init(ctx);
+}
+
+const uint8_t *hash_data(const void *data, size_t len, uint8_t *digest, bool sha256) {
+    HASH_CTX ctx;
+    hash_init(&ctx, sha256);
+    // Updates take an int
+    auto p = static_cast<const uint8_t *>(data);
+    for (size_t n; len; p += n, len -= n) {
+        n = std::min<size_t>(len, INT_MAX & ~63);
+        HASH_update(&ctx, p, n);
+    }
+    memcpy(digest, HASH_final(&ctx), HASH_size(&ctx));
+    return digest;
+}
+
+#if defined(SHA_X86)
+
+static inline __m128i load(const uint8_t *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+// Multiply both halves of x by the constants in k and fold the product into next
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i fold(__m128i x, __m128i k, __m128i next) {
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+}
+
+// Folding with carry-less multiplication, from Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction". len is a multiple of 16, at least 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *buf, size_t len) {
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    // Fold 4 lanes of 128 bits in parallel
+    __m128i x1 = _mm_xor_si128(load(buf), _mm_cvtsi32_si128(crc));
+    __m128i x2 = load(buf + 16);
+    __m128i x3 = load(buf + 32);
+    __m128i x4 = load(buf + 48);
+    __m128i k = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+    for (buf += 64, len -= 64; len >= 64; buf += 64, len -= 64) {
+        x1 = fold(x1, k, load(buf));
+        x2 = fold(x2, k, load(buf + 16));
+        x3 = fold(x3, k, load(buf + 32));
+        x4 = fold(x4, k, load(buf + 48));
+    }
+
+    // Fold into a single lane, then the remaining 16 byte blocks
+    k = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+    x1 = fold(x1, k, x2);
+    x1 = fold(x1, k, x3);
+    x1 = fold(x1, k, x4);
+    for (; len >= 16; buf += 16, len -= 16)
+        x1 = fold(x1, k, load(buf));
+
+    // Fold 128 bits to 64 bits
+    __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    k = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+    return _mm_extract_epi32(_mm_xor_si128(x1, x2), 1);
+}
+
+static bool cpu_has_clmul() {
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+
+#endif
+
+uint32_t crc32_fast(uint32_t crc, const void *data, size_t len) {
+    auto p = static_cast<const uint8_t *>(data);
+#if defined(SHA_X86)
+    static const bool clmul = cpu_has_clmul();
+    if (clmul && len >= 64) {
+        size_t n = len & ~15;
+        crc = ~crc32_clmul(~crc, p, n);
+        p += n;
+        len -= n;
+    }
+#elif defined(CRC_ARM)
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32d(crc, v);
+    }
+    for (; len; ++p, --len)
+        crc = __crc32b(crc, *p);
+    return ~crc;
+#endif
+    // zlib takes an unsigned length
+    for (size_t n; len; p += n, len -= n) {
+        n = std::min<size_t>(len, UINT_MAX);
+        crc = crc32(crc, p, n);
+    }
+    return crc;
+}
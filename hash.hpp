@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mincrypt/sha.h>
+#include <mincrypt/sha256.h>
+
+// Same as SHA_init / SHA256_init, but with the SHA instructions of the CPU
+// (SHA-NI on x86_64, the ARMv8 crypto extensions on arm64) when available
+void hash_init(HASH_CTX *ctx, bool sha256);
+
+// Hash of len bytes of data into digest, returns digest
+const uint8_t *hash_data(const void *data, size_t len, uint8_t *digest, bool sha256);
+
+// Same as zlib's crc32(), with PCLMULQDQ folding on x86_64 or the ARMv8 CRC32
+// instructions on arm64 when available
+uint32_t crc32_fast(uint32_t crc, const void *data, size_t len);
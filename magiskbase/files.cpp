@@ -1,6 +1,7 @@
 #ifndef SVB_WIN32
 #if defined(__linux__)
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
 #elif defined(__APPLE__)
 // macOS uses a different sendfile, or it's part of unistd.h / sys/socket.h
@@ -353,15 +354,72 @@ string full_read(const char *filename) {
 }
 
 void write_zero(int fd, size_t size) {
+    if (size == 0)
+        return;
+
+    // Leave a hole in regular files instead of writing the zeros
+    struct stat st;
+    off_t cur = lseek(fd, 0, SEEK_CUR);
+    if (cur >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t end = cur + size;
+        bool sparse = false;
+        if (cur >= st.st_size) {
+            // Extending the file reads back as zeros
+            sparse = ftruncate(fd, end) == 0;
+        } else {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+            // Deallocate existing data, then extend the file if needed
+            sparse = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, cur, size) == 0 &&
+                     (end <= st.st_size || ftruncate(fd, end) == 0);
+#endif
+        }
+        if (sparse && lseek(fd, end, SEEK_SET) == end)
+            return;
+    }
+
     char buf[4096] = {0};
     size_t len;
     while (size > 0) {
         len = sizeof(buf) > size ? size : sizeof(buf);
-        write(fd, buf, len);
+        if (xwrite(fd, buf, len) != (ssize_t) len)
+            return;
         size -= len;
     }
 }
 
+size_t copy_range(int src, off_t src_off, int dst, off_t dst_off, size_t len) {
+    size_t done = 0;
+#if defined(__linux__)
+#ifdef FICLONERANGE
+    struct stat st;
+    if (fstat(dst, &st) == 0 && st.st_blksize > 0) {
+        // Share the extents on filesystems supporting reflinks (btrfs, XFS), which
+        // only works on whole blocks at the same alignment in both files
+        size_t blk = st.st_blksize;
+        file_clone_range range {};
+        range.src_fd = src;
+        range.src_offset = src_off;
+        range.src_length = len / blk * blk;
+        range.dest_offset = dst_off;
+        if (src_off % blk == 0 && dst_off % blk == 0 && range.src_length &&
+            ioctl(dst, FICLONERANGE, &range) == 0)
+            done = range.src_length;
+    }
+#endif
+#ifdef __NR_copy_file_range
+    while (done < len) {
+        loff_t in = src_off + done;
+        loff_t out = dst_off + done;
+        long n = syscall(__NR_copy_file_range, src, &in, dst, &out, len - done, 0);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+#endif
+#endif
+    return done;
+}
+
 void file_readline(bool trim, FILE *fp, const function<bool(string_view)> &fn) {
     size_t len = 1024;
     char *buf = (char *) malloc(len);
@@ -93,6 +93,10 @@ void full_read(const char *filename, std::string &str);
 std::string full_read(int fd);
 std::string full_read(const char *filename);
 void write_zero(int fd, size_t size);
+// Copy len bytes between files within the kernel, without going through userspace.
+// Returns the number of bytes copied, which is less than len (possibly 0) when the
+// files or the platform do not support it, the rest is left to the caller.
+size_t copy_range(int src, off_t src_off, int dst, off_t dst_off, size_t len);
 void file_readline(bool trim, FILE *fp, const std::function<bool(std::string_view)> &fn);
 void file_readline(bool trim, const char *file, const std::function<bool(std::string_view)> &fn);
 void file_readline(const char *file, const std::function<bool(std::string_view)> &fn);
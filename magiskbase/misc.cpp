@@ -5,6 +5,8 @@
 #include <signal.h>
 #include <random>
 #include <string>
+#include <atomic>
+#include <vector>
 
 #include <base.hpp>
 
@@ -155,6 +157,38 @@ int new_daemon_thread(thread_entry entry, void *arg) {
     return xpthread_create(&thread, &attr, entry, arg);
 }
 
+namespace {
+struct parallel_ctx {
+    const function<void(size_t)> &fn;
+    size_t n;
+    atomic<size_t> next;
+};
+}
+
+static void *parallel_worker(void *arg) {
+    auto ctx = static_cast<parallel_ctx *>(arg);
+    for (size_t i; (i = ctx->next.fetch_add(1, memory_order_relaxed)) < ctx->n;)
+        ctx->fn(i);
+    return nullptr;
+}
+
+void parallel_for(size_t n, const function<void(size_t)> &fn) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = std::min<size_t>(cpus > 1 ? cpus : 1, n);
+    parallel_ctx ctx{ fn, n, {0} };
+    vector<pthread_t> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        pthread_t thread;
+        // Running with less workers is fine, the calling thread picks up the rest
+        if (pthread_create(&thread, nullptr, parallel_worker, &ctx) != 0)
+            break;
+        workers.push_back(thread);
+    }
+    parallel_worker(&ctx);
+    for (auto thread : workers)
+        pthread_join(thread, nullptr);
+}
+
 /*
  * Bionic's atoi runs through strtol().
  * Use our own implementation for faster conversion.
@@ -169,8 +203,46 @@ int parse_int(string_view s) {
     }
     return val;
 }
+#else
+void parallel_for(size_t n, const function<void(size_t)> &fn) {
+    for (size_t i = 0; i < n; ++i)
+        fn(i);
+}
 #endif
 
+mem_log::mem_log() {
+#if defined(SVB_WIN32) || defined(SVB_MINGW)
+    file = tmpfile();
+#else
+    file = open_memstream(&buf, &len);
+#endif
+    // Nowhere to buffer, messages are printed right away
+    if (file == nullptr)
+        file = stderr;
+}
+
+string mem_log::take() {
+    string s;
+    if (file == nullptr || file == stderr) {
+        file = nullptr;
+        return s;
+    }
+#if defined(SVB_WIN32) || defined(SVB_MINGW)
+    rewind(file);
+    char chunk[4096];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+        s.append(chunk, n);
+    fclose(file);
+#else
+    fclose(file);
+    s.assign(buf, len);
+    free(buf);
+    buf = nullptr;
+#endif
+    file = nullptr;
+    return s;
+}
+
 uint32_t binary_gcd(uint32_t u, uint32_t v) {
     if (u == 0) return v;
     if (v == 0) return u;
@@ -2,6 +2,7 @@
 #ifndef SVB_WIN32
 #include <pthread.h>
 #endif
+#include <stdio.h>
 #include <string>
 #include <functional>
 #include <string_view>
@@ -124,6 +125,29 @@ int parse_int(std::string_view s);
 using thread_entry = void *(*)(void *);
 int new_daemon_thread(thread_entry entry, void *arg = nullptr);
 #endif
+
+// Call fn(i) for every i in [0, n) on all online CPUs, the calling thread included.
+// Returns once every call has finished. Calls run one after the other on Windows.
+void parallel_for(size_t n, const std::function<void(size_t)> &fn);
+
+// Output kept in memory, such as the messages of a parallel_for call that are printed
+// in a fixed order afterwards. Uses a temporary file where open_memstream is missing.
+class mem_log {
+    DISALLOW_COPY_AND_MOVE(mem_log)
+public:
+    mem_log();
+    ~mem_log() { take(); }
+    FILE *fp() const { return file; }
+    // False if there was nowhere to buffer, fp() is stderr then
+    bool buffered() const { return file != stderr; }
+    // Close the stream and return everything written to it
+    std::string take();
+private:
+    FILE *file;
+    char *buf = nullptr;
+    size_t len = 0;
+};
+
 static inline bool str_contains(std::string_view s, std::string_view ss) {
     return s.find(ss) != std::string::npos;
 }
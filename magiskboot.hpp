@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <stdio.h>
 
 #define HEADER_FILE     "header"
 #define KERNEL_FILE     "kernel"
@@ -11,14 +12,17 @@
 #define RECV_DTBO_FILE  "recovery_dtbo"
 #define DTB_FILE        "dtb"
 #define NEW_BOOT        "new-boot.img"
+#define STATE_EXT       ".state"
+#define MANIFEST_FILE   "manifest"
 
 int unpack(const char *image, bool skip_decomp = false, bool hdr = false);
+int info(const char *image);
 void repack(const char *src_img, const char *out_img, bool skip_comp = false);
 int split_image_dtb(const char *filename);
 int hexpatch(const char *file, const char *from, const char *to);
 int cpio_commands(int argc, char *argv[]);
 int dtb_commands(int argc, char *argv[]);
 
-uint32_t patch_verity(void *buf, uint32_t size);
-uint32_t patch_encryption(void *buf, uint32_t size);
+uint32_t patch_verity(void *buf, uint32_t size, FILE *log = stderr);
+uint32_t patch_encryption(void *buf, uint32_t size, FILE *log = stderr);
 bool check_env(const char *name);
@@ -1,10 +1,10 @@
-#include <mincrypt/sha.h>
 #include <base.hpp>
 #include <getopt.h>
 #include <unistd.h>
 
 #include "magiskboot.hpp"
 #include "compress.hpp"
+#include "hash.hpp"
 
 using namespace std;
 
@@ -30,12 +30,20 @@ Supported actions:
     on-the-fly before writing to the output file.
     If '-n' is provided, all decompression operations will be skipped;
     each component will remain untouched, dumped in its original format.
+    Decompressed components are recorded in the file 'manifest', so that
+    repack can reuse their original compressed data if left unchanged.
     If '-h' is provided, the boot image header information will be
     dumped to the file 'header', which can be used to modify header
     configurations during repacking.
     Return values:
     0:valid    1:error    2:chromeos
 
+  info <bootimg>
+    Print the header information of <bootimg> to STDOUT as JSON: image
+    format and flags, header fields, and the offset, size and format of
+    each component. Only the headers and the end of <bootimg> are read,
+    so it is also cheap on whole partitions and block devices.
+
   repack [-n] <origbootimg> [outbootimg]
     Repack boot image components using files from the current directory
     to [outbootimg], or 'new-boot.img' if not specified.
@@ -47,6 +55,10 @@ Supported actions:
     If '-n' is provided, all compression operations will be skipped.
     If env variable PATCHVBMETAFLAG is set to true, all disable flags in
     the boot image's vbmeta header will be set.
+    If env variable RAMDISKOVERLAY is set to true and the ramdisk only had
+    entries added or changed, the original compressed ramdisk is kept as is
+    and the changes are appended as a new compressed cpio segment
+    (gzip and lz4 formats only).
 
   hexpatch <file> <hexpattern1> <hexpattern2>
     Search <hexpattern1> in <file>, and replace it with <hexpattern2>
@@ -54,6 +66,12 @@ Supported actions:
   cpio <incpio> [commands...]
     Do cpio commands to <incpio> (modifications are done in-place)
     Each command is a single argument, add quotes for each command.
+    Hardlinks in <incpio> are preserved. If env variable CPIODEDUP is set
+    to true, regular files with identical content and attributes are
+    stored only once, as hardlinks. If env variable CPIOREORDER is set to
+    true, directories are written first and the remaining entries are
+    grouped by content type to compress better, reporting the estimated
+    compressed size change.
     Supported commands:
       exists ENTRY
         Return 0 if ENTRY exists, else return 1
@@ -81,12 +99,16 @@ Supported actions:
       patch
         Apply ramdisk patches
         Configure with env variables: KEEPVERITY KEEPFORCEENCRYPT
+        Extra flags to strip can be listed in env variables EXTRAVERITYFLAGS
+        and EXTRAENCRYPTFLAGS, separated by commas, or @FILE to read FILE
       backup ORIG
         Create ramdisk backups from ORIG
       restore
         Restore ramdisk from ramdisk backup stored within incpio
       sha1
         Print stock boot SHA1 if previously backed up in ramdisk
+      script FILE
+        Run the commands listed in FILE, one per line ('-' for stdin)
   cpio pack [-c <config>] <infolder> <outcpio>
     Creates <outcpio> from <infolder> entries.
     Entries mode are read from <config> ("cpio" if undefined) to support changing modes in Windows.
@@ -100,7 +122,7 @@ Supported actions:
       patch
         Search for fstab and remove verity/avb
         Modifications are done directly to the file in-place
-        Configure with env variables: KEEPVERITY
+        Configure with env variables: KEEPVERITY EXTRAVERITYFLAGS
       test
         Test the fstab's status
         Return values:
@@ -160,10 +182,12 @@ int main(int argc, char *argv[]) {
         unlink(EXTRA_FILE);
         unlink(RECV_DTBO_FILE);
         unlink(DTB_FILE);
+        unlink(MANIFEST_FILE);
+        unlink("ramdisk" STATE_EXT);
     } else if (argc > 2 && action == "sha1") {
         uint8_t sha1[SHA_DIGEST_SIZE];
         auto m = mmap_data(argv[2]);
-        SHA_hash(m.buf, m.sz, sha1);
+        hash_data(m.buf, m.sz, sha1, false);
         for (uint8_t i : sha1)
             printf("%02x", i);
         printf("\n");
@@ -189,6 +213,8 @@ int main(int argc, char *argv[]) {
             ++idx;
         }
         return unpack(argv[idx], nodecomp, hdr);
+    } else if (argc > 2 && action == "info") {
+        return info(argv[2]);
     } else if (argc > 2 && action == "repack") {
         if (argv[2] == "-n"sv) {
             if (argc == 3)
@@ -1,50 +1,130 @@
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <queue>
+
 #include <base.hpp>
 
 #include "magiskboot.hpp"
 
-#define MATCH(p) else if (strncmp(s + skip, p, sizeof(p) - 1) == 0) skip += (sizeof(p) - 1)
+using namespace std;
+
+static const char *VERITY_FLAGS[] =
+        { "verifyatboot", "verify", "avb_keys", "avb", "support_scfs", "fsverity" };
+
+static const char *ENCRYPTION_FLAGS[] =
+        { "forceencrypt", "forcefdeorfbe", "fileencryption" };
+
+// Aho-Corasick automaton, finds every occurrence of all keywords in a single pass
+class flag_matcher {
+public:
+    explicit flag_matcher(const vector<string> &keys);
+
+    // Length of the longest keyword starting at each offset of buf, 0 if none
+    void scan(const char *buf, uint32_t size, vector<uint32_t> &longest) const;
 
-static int skip_verity_pattern(const char *s) {
-    int skip = s[0] == ',';
+private:
+    struct node {
+        int go[256];
+        // Longest proper suffix which is also a prefix of some keyword
+        int fail = 0;
+        // Next node on the fail chain that ends a keyword
+        int dict = -1;
+        // Length of the keyword ending here, 0 if none
+        uint32_t len = 0;
+    };
 
-    if (0) {}
-    MATCH("verifyatboot");
-    MATCH("verify");
-    MATCH("avb_keys");
-    MATCH("avb");
-    MATCH("support_scfs");
-    MATCH("fsverity");
-    else return -1;
+    vector<node> nodes;
+};
 
-    if (s[skip] == '=') {
-        while (!strchr(" \n,", s[skip]))
-            ++skip;
+flag_matcher::flag_matcher(const vector<string> &keys) : nodes(1) {
+    std::fill(std::begin(nodes[0].go), std::end(nodes[0].go), -1);
+    for (auto &key : keys) {
+        int cur = 0;
+        for (unsigned char c : key) {
+            if (nodes[cur].go[c] < 0) {
+                nodes[cur].go[c] = nodes.size();
+                nodes.emplace_back();
+                std::fill(std::begin(nodes.back().go), std::end(nodes.back().go), -1);
+            }
+            cur = nodes[cur].go[c];
+        }
+        nodes[cur].len = key.size();
     }
-    return skip;
-}
 
-static int skip_encryption_pattern(const char *s) {
-    int skip = s[0] == ',';
+    // Fill in failure links breadth first, turning the trie into a full DFA
+    queue<int> q;
+    for (int &next : nodes[0].go) {
+        if (next < 0) {
+            next = 0;
+        } else {
+            q.push(next);
+        }
+    }
+    while (!q.empty()) {
+        int cur = q.front();
+        q.pop();
+        for (int c = 0; c < 256; ++c) {
+            int next = nodes[cur].go[c];
+            int fallback = nodes[nodes[cur].fail].go[c];
+            if (next < 0) {
+                nodes[cur].go[c] = fallback;
+                continue;
+            }
+            nodes[next].fail = fallback;
+            nodes[next].dict = nodes[fallback].len ? fallback : nodes[fallback].dict;
+            q.push(next);
+        }
+    }
+}
 
-    if (0) {}
-    MATCH("forceencrypt");
-    MATCH("forcefdeorfbe");
-    MATCH("fileencryption");
-    else return -1;
+void flag_matcher::scan(const char *buf, uint32_t size, vector<uint32_t> &longest) const {
+    longest.assign(size + 1, 0);
+    int cur = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        cur = nodes[cur].go[(unsigned char) buf[i]];
+        for (int n = nodes[cur].len ? cur : nodes[cur].dict; n > 0; n = nodes[n].dict) {
+            uint32_t start = i + 1 - nodes[n].len;
+            longest[start] = std::max(longest[start], nodes[n].len);
+        }
+    }
+}
 
-    if (s[skip] == '=') {
-        while (!strchr(" \n,", s[skip]))
-            ++skip;
+// Builtin flags and extra ones from env variable name. The variable holds a list
+// separated by commas or whitespaces, or @FILE to read the list from FILE.
+static vector<string> flag_list(const char **flags, size_t num, const char *name) {
+    vector<string> keys(flags, flags + num);
+    const char *val = getenv(name);
+    if (val == nullptr)
+        return keys;
+    string list = val[0] == '@' ? full_read(val + 1) : val;
+    for (size_t i = 0; i < list.size();) {
+        size_t end = i;
+        while (end < list.size() && list[end] != ',' && !isspace((unsigned char) list[end]))
+            ++end;
+        if (end > i)
+            keys.emplace_back(list, i, end - i);
+        i = end + 1;
     }
-    return skip;
+    return keys;
 }
 
-static uint32_t remove_pattern(char *src, uint32_t size, int(*pattern_skip)(const char *)) {
-    int orig_sz = size;
-    int write = 0;
-    for (int read = 0; read < orig_sz;) {
-        if (int skip = pattern_skip(src + read); skip > 0) {
-            fprintf(stderr, "Remove pattern [%.*s]\n", skip, src + read);
+static uint32_t remove_pattern(char *src, uint32_t size, const flag_matcher &matcher, FILE *log) {
+    vector<uint32_t> longest;
+    matcher.scan(src, size, longest);
+
+    uint32_t orig_sz = size;
+    uint32_t write = 0;
+    for (uint32_t read = 0; read < orig_sz;) {
+        // A keyword, optionally with its leading comma and its value
+        uint32_t skip = src[read] == ',';
+        if (uint32_t len = longest[read + skip]; len) {
+            skip += len;
+            if (read + skip < orig_sz && src[read + skip] == '=') {
+                while (read + skip < orig_sz && !strchr(" \n,", src[read + skip]))
+                    ++skip;
+            }
+            fprintf(log, "Remove pattern [%.*s]\n", (int) skip, src + read);
             size -= skip;
             read += skip;
         } else {
@@ -55,10 +135,12 @@ static uint32_t remove_pattern(char *src, uint32_t size, int(*pattern_skip)(cons
     return size;
 }
 
-uint32_t patch_verity(void *buf, uint32_t size) {
-    return remove_pattern(static_cast<char *>(buf), size, skip_verity_pattern);
+uint32_t patch_verity(void *buf, uint32_t size, FILE *log) {
+    static flag_matcher matcher(flag_list(VERITY_FLAGS, std::size(VERITY_FLAGS), "EXTRAVERITYFLAGS"));
+    return remove_pattern(static_cast<char *>(buf), size, matcher, log);
 }
 
-uint32_t patch_encryption(void *buf, uint32_t size) {
-    return remove_pattern(static_cast<char *>(buf), size, skip_encryption_pattern);
+uint32_t patch_encryption(void *buf, uint32_t size, FILE *log) {
+    static flag_matcher matcher(flag_list(ENCRYPTION_FLAGS, std::size(ENCRYPTION_FLAGS), "EXTRAENCRYPTFLAGS"));
+    return remove_pattern(static_cast<char *>(buf), size, matcher, log);
 }
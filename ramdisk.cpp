@@ -1,6 +1,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h> // For R_OK, access
+#include <algorithm>
+#include <optional>
 
 #include <base.hpp>
 
@@ -32,35 +34,66 @@ bool check_env(const char *name) {
     return val != nullptr && val == "true"sv;
 }
 
+// Rewrites the content of the entries it selects
+struct entry_patcher {
+    function<bool(string_view name, const cpio_entry *e)> match;
+    function<void(string_view name, cpio_entry *e, FILE *log)> patch;
+};
+
+// Apply all patchers in a single traversal. Entries are patched in parallel, each one
+// by every matching patcher in registration order. Messages are buffered per entry
+// and printed in table order, so the output does not depend on scheduling.
+static void patch_entries(cpio::entry_map &entries, const vector<entry_patcher> &patchers) {
+    vector<string> logs(entries.size());
+    parallel_for(entries.size(), [&](size_t i) {
+        auto &[name, e] = entries[i];
+        optional<mem_log> log;
+        for (auto &p : patchers) {
+            if (!p.match(name, e))
+                continue;
+            if (!log)
+                log.emplace();
+            p.patch(name, e, log->fp());
+        }
+        if (log)
+            logs[i] = log->take();
+    });
+    for (auto &log : logs)
+        fwrite(log.data(), 1, log.size(), stderr);
+}
+
+static bool is_fstab(string_view name, const cpio_entry *e) {
+    return S_ISREG(e->mode) &&
+           !str_starts(name, ".backup") &&
+           !str_contains(name, "twrp") &&
+           !str_contains(name, "recovery") &&
+           str_contains(name, "fstab");
+}
+
 void magisk_cpio::patch() {
     bool keepverity = check_env("KEEPVERITY");
     bool keepforceencrypt = check_env("KEEPFORCEENCRYPT");
     fprintf(stderr, "Patch with flag KEEPVERITY=[%s] KEEPFORCEENCRYPT=[%s]\n",
             keepverity ? "true" : "false", keepforceencrypt ? "true" : "false");
-
-    for (auto it = entries.begin(); it != entries.end();) {
-        auto cur = it++;
-        bool fstab = (!keepverity || !keepforceencrypt) &&
-                     S_ISREG(cur->second->mode) &&
-                     !str_starts(cur->first, ".backup") &&
-                     !str_contains(cur->first, "twrp") &&
-                     !str_contains(cur->first, "recovery") &&
-                     str_contains(cur->first, "fstab");
-        if (!keepverity) {
-            if (fstab) {
-                fprintf(stderr, "Found fstab file [%s]\n", cur->first.data());
-                cur->second->filesize = patch_verity(cur->second->data, cur->second->filesize);
-            } else if (cur->first == "verity_key") {
-                rm(cur);
-                continue;
-            }
-        }
-        if (!keepforceencrypt) {
-            if (fstab) {
-                cur->second->filesize = patch_encryption(cur->second->data, cur->second->filesize);
-            }
-        }
+    load_entries();
+    modified();
+
+    vector<entry_patcher> patchers;
+    if (!keepverity) {
+        patchers.push_back({ is_fstab, [](string_view name, cpio_entry *e, FILE *log) {
+            fprintf(log, "Found fstab file [%s]\n", name.data());
+            e->filesize = patch_verity(e->data, e->filesize, log);
+        }});
+    }
+    if (!keepforceencrypt) {
+        patchers.push_back({ is_fstab, [](string_view, cpio_entry *e, FILE *log) {
+            e->filesize = patch_encryption(e->data, e->filesize, log);
+        }});
     }
+    patch_entries(entries, patchers);
+
+    if (!keepverity)
+        rm("verity_key");
 }
 
 #define MAGISK_PATCHED    (1 << 0)
@@ -90,25 +123,29 @@ for (char *line = (char *) buf; line < (char *) buf + size && line[0]; line = st
 
 char *magisk_cpio::sha1() {
     char sha1[41];
-    for (auto &e : entries) {
-        if (e.first == "init.magisk.rc" || e.first == "overlay/init.magisk.rc") {
-            for_each_line(line, e.second->data, e.second->filesize) {
+    // Only these entries are read, in name order
+    for (string_view name : { ".backup/.magisk", ".backup/.sha1", "init.magisk.rc", "overlay/init.magisk.rc" }) {
+        auto e = get(name);
+        if (e == nullptr)
+            continue;
+        if (name == "init.magisk.rc" || name == "overlay/init.magisk.rc") {
+            for_each_line(line, e->data, e->filesize) {
                 if (strncmp(line, "#STOCKSHA1=", 11) == 0) {
                     strncpy(sha1, line + 12, 40);
                     sha1[40] = '\0';
                     return strdup(sha1);
                 }
             }
-        } else if (e.first == ".backup/.magisk") {
-            for_each_line(line, e.second->data, e.second->filesize) {
+        } else if (name == ".backup/.magisk") {
+            for_each_line(line, e->data, e->filesize) {
                 if (str_starts(line, "SHA1=")) {
                     strncpy(sha1, line + 5, 40);
                     sha1[40] = '\0';
                     return strdup(sha1);
                 }
             }
-        } else if (e.first == ".backup/.sha1") {
-            return (char *) e.second->data;
+        } else if (name == ".backup/.sha1") {
+            return (char *) e->data;
         }
     }
     return nullptr;
@@ -118,56 +155,59 @@ char *magisk_cpio::sha1() {
 for (char *str = (char *) buf; str < (char *) buf + size; str += strlen(str) + 1)
 
 void magisk_cpio::restore() {
+    load_entries();
+    modified();
     // Collect files
-    auto bk = entries.end();
-    auto rl = entries.end();
-    auto mg = entries.end();
-    vector<entry_map::iterator> backups;
-    for (auto it = entries.begin(); it != entries.end(); ++it) {
-        if (it->first == ".backup") {
-            bk = it;
-        } else if (it->first == ".backup/.rmlist") {
-            rl = it;
-        } else if (it->first == ".backup/.magisk") {
-            mg = it;
-        } else if (str_starts(it->first, ".backup/")) {
-            backups.emplace_back(it);
+    cpio_entry *bk = nullptr;
+    cpio_entry *rl = nullptr;
+    cpio_entry *mg = nullptr;
+    vector<string_view> backups;
+    for (auto &e : entries) {
+        if (e.first == ".backup") {
+            bk = e.second;
+        } else if (e.first == ".backup/.rmlist") {
+            rl = e.second;
+        } else if (e.first == ".backup/.magisk") {
+            mg = e.second;
+        } else if (str_starts(e.first, ".backup/")) {
+            backups.emplace_back(e.first);
         }
     }
 
     // If the .backup folder is effectively empty, this means that the boot ramdisk was
     // created from scratch by an old broken magiskboot. This is just a hacky workaround.
-    if (bk != entries.end() && mg != entries.end() && rl == entries.end() && backups.empty()) {
+    if (bk && mg && !rl && backups.empty()) {
         fprintf(stderr, "Remove all in ramdisk\n");
         entries.clear();
         return;
     }
 
-    // Remove files
-    rm(bk);
-    rm(mg);
-    if (rl != entries.end()) {
-        for_each_str(file, rl->second->data, rl->second->filesize) {
-            rm(file);
+    // Remove and restore files in a single pass
+    vector<batch_op> ops;
+    ops.push_back({ ".backup", "" });
+    ops.push_back({ ".backup/.magisk", "" });
+    if (rl) {
+        for_each_str(file, rl->data, rl->filesize) {
+            ops.push_back({ file, "" });
         }
-        rm(rl);
-    }
-
-    // Restore files
-    for (auto it : backups) {
-        const char *name = &it->first[8];
-        mv(it, name);
+        ops.push_back({ ".backup/.rmlist", "" });
     }
+    for (auto name : backups)
+        ops.push_back({ string(name), string(name.substr(8)) });
+    batch(ops);
 }
 
 void magisk_cpio::backup(const char *orig) {
+    load_entries();
+    modified();
     entry_map backups;
     string rm_list;
-    backups.emplace(".backup", new cpio_entry(S_IFDIR));
+    backups.emplace_back(arena.str(".backup"), arena.entry(S_IFDIR));
 
     magisk_cpio o;
     if (access(orig, R_OK) == 0)
         o.load_cpio(orig);
+    o.load_entries();
 
     // Remove existing backups in original ramdisk
     o.rm(".backup", true);
@@ -206,10 +246,11 @@ void magisk_cpio::backup(const char *orig) {
         }
 
         if (do_backup) {
-            string name = ".backup/" + lhs->first;
+            string name = ".backup/"s.append(lhs->first);
             fprintf(stderr, "[%s] -> [%s]\n", lhs->first.data(), name.data());
-            auto e = lhs->second.release();
-            backups.emplace(name, e);
+            // The original ramdisk goes away with its arena and mapping, move the entry into ours
+            lhs->second->materialize();
+            backups.emplace_back(arena.str(name), arena.entry(std::move(*lhs->second)));
         }
 
         // Increment positions
@@ -223,19 +264,110 @@ void magisk_cpio::backup(const char *orig) {
     }
 
     if (!rm_list.empty()) {
-        auto rm_list_file = new cpio_entry(S_IFREG);
+        auto rm_list_file = arena.entry(S_IFREG);
         rm_list_file->filesize = rm_list.length();
         rm_list_file->data = xmalloc(rm_list.length());
         memcpy(rm_list_file->data, rm_list.data(), rm_list.length());
-        backups.emplace(".backup/.rmlist", rm_list_file);
+        backups.emplace_back(arena.str(".backup/.rmlist"), rm_list_file);
     }
 
-    if (backups.size() > 1)
-        entries.merge(backups);
+    if (backups.size() > 1) {
+        auto cmp = [](const entry_t &a, const entry_t &b) { return a.first < b.first; };
+        sort(backups.begin(), backups.end(), cmp);
+        auto mid = entries.insert(entries.end(), backups.begin(), backups.end());
+        inplace_merge(entries.begin(), mid, entries.end(), cmp);
+    }
+}
+
+// Returned by cpio_command to carry on with the next command
+#define CMD_NEXT -1
+
+static int cpio_command(magisk_cpio &cpio, vector<cpio::batch_op> &ops, char *cmd);
+
+static int cpio_script(magisk_cpio &cpio, vector<cpio::batch_op> &ops, const char *file) {
+    FILE *fp = file == "-"sv ? stdin : xfopen(file, "re");
+    char *line = nullptr;
+    size_t cap = 0;
+    int ret = CMD_NEXT;
+    while (ret == CMD_NEXT && getline(&line, &cap, fp) >= 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        ret = cpio_command(cpio, ops, line);
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    return ret;
+}
+
+static int cpio_command(magisk_cpio &cpio, vector<cpio::batch_op> &ops, char *cmd) {
+    unsigned int cmdc = 0;
+    char *cmdv[6] = {};
+
+    // Split the command
+    char *tok = strtok(cmd, " ");
+    while (tok && cmdc < std::size(cmdv)) {
+        if (cmdc == 0 && tok[0] == '#')
+            break;
+        cmdv[cmdc++] = tok;
+        tok = strtok(nullptr, " ");
+    }
+
+    if (cmdc == 0)
+        return CMD_NEXT;
+
+    // Consecutive removals and moves are queued and applied together
+    if (cmdc >= 2 && cmdv[0] == "rm"sv) {
+        bool r = cmdc > 2 && cmdv[1] == "-r"sv;
+        ops.push_back({ cmdv[1 + r], "", r });
+        return CMD_NEXT;
+    } else if (cmdc == 3 && cmdv[0] == "mv"sv) {
+        ops.push_back({ cmdv[1], cmdv[2] });
+        return CMD_NEXT;
+    }
+    cpio.batch(ops);
+    ops.clear();
+
+    if (cmdv[0] == "test"sv) {
+        exit(cpio.test());
+    } else if (cmdv[0] == "restore"sv) {
+        cpio.restore();
+    } else if (cmdv[0] == "sha1"sv) {
+        char *sha1 = cpio.sha1();
+        if (sha1) printf("%s\n", sha1);
+        return 0;
+    } else if (cmdv[0] == "patch"sv) {
+        cpio.patch();
+    } else if (cmdc == 2 && cmdv[0] == "script"sv) {
+        return cpio_script(cpio, ops, cmdv[1]);
+    } else if (cmdc == 2 && cmdv[0] == "exists"sv) {
+        exit(!cpio.exists(cmdv[1]));
+    } else if (cmdc == 2 && cmdv[0] == "backup"sv) {
+        cpio.backup(cmdv[1]);
+    } else if (cmdv[0] == "extract"sv) {
+        if (cmdc == 3) {
+            return !cpio.extract(cmdv[1], cmdv[2]);
+        } else {
+            cpio.extract();
+            return 0;
+        }
+    } else if (cmdv[0] == "sync"sv) {
+        cpio.load_cpio("ramdisk", "cpio", true);
+    } else if (cmdc == 3 && cmdv[0] == "mkdir"sv) {
+        cpio.mkdir(strtoul(cmdv[1], nullptr, 8), cmdv[2]);
+    } else if (cmdc == 3 && cmdv[0] == "ln"sv) {
+        cpio.ln(cmdv[1], cmdv[2]);
+    } else if (cmdc == 4 && cmdv[0] == "add"sv) {
+        cpio.add(strtoul(cmdv[1], nullptr, 8), cmdv[2], cmdv[3]);
+    } else {
+        return 1;
+    }
+    return CMD_NEXT;
 }
 
 int cpio_commands(int argc, char *argv[]) {
     magisk_cpio cpio;
+    cpio.dedup = check_env("CPIODEDUP");
+    cpio.reorder = check_env("CPIOREORDER");
 
     /* pack doesn`t need incpio */
     if (argc >= 3 && argv[0] == "pack"sv) {
@@ -252,64 +384,13 @@ int cpio_commands(int argc, char *argv[]) {
     if (access(incpio, R_OK) == 0)
         cpio.load_cpio(incpio);
 
-    unsigned int cmdc;
-    char *cmdv[6];
-
+    vector<cpio::batch_op> ops;
     for (int i = 0; i < argc; ++i) {
-        // Reset
-        cmdc = 0;
-        memset(cmdv, 0, sizeof(cmdv));
-
-        // Split the commands
-        char *tok = strtok(argv[i], " ");
-        while (tok && cmdc < std::size(cmdv)) {
-            if (cmdc == 0 && tok[0] == '#')
-                break;
-            cmdv[cmdc++] = tok;
-            tok = strtok(nullptr, " ");
-        }
-
-        if (cmdc == 0)
-            continue;
-
-        if (cmdv[0] == "test"sv) {
-            exit(cpio.test());
-        } else if (cmdv[0] == "restore"sv) {
-            cpio.restore();
-        } else if (cmdv[0] == "sha1"sv) {
-            char *sha1 = cpio.sha1();
-            if (sha1) printf("%s\n", sha1);
-            return 0;
-        } else if (cmdv[0] == "patch"sv) {
-            cpio.patch();
-        } else if (cmdc == 2 && cmdv[0] == "exists"sv) {
-            exit(!cpio.exists(cmdv[1]));
-        } else if (cmdc == 2 && cmdv[0] == "backup"sv) {
-            cpio.backup(cmdv[1]);
-        } else if (cmdc >= 2 && cmdv[0] == "rm"sv) {
-            bool r = cmdc > 2 && cmdv[1] == "-r"sv;
-            cpio.rm(cmdv[1 + r], r);
-        } else if (cmdc == 3 && cmdv[0] == "mv"sv) {
-            cpio.mv(cmdv[1], cmdv[2]);
-        } else if (cmdv[0] == "extract"sv) {
-            if (cmdc == 3) {
-                return !cpio.extract(cmdv[1], cmdv[2]);
-            } else {
-                cpio.extract();
-                return 0;
-            }
-        } else if (cmdv[0] == "sync"sv) {
-            cpio.load_cpio("ramdisk", "cpio", true);
-        } else if (cmdc == 3 && cmdv[0] == "mkdir"sv) {
-            cpio.mkdir(strtoul(cmdv[1], nullptr, 8), cmdv[2]);
-        } else if (cmdc == 3 && cmdv[0] == "ln"sv) {
-            cpio.ln(cmdv[1], cmdv[2]);
-        } else if (cmdc == 4 && cmdv[0] == "add"sv) {
-            cpio.add(strtoul(cmdv[1], nullptr, 8), cmdv[2], cmdv[3]);
-        } else {
-            return 1;
-        }
+        int ret = cpio_command(cpio, ops, argv[i]);
+        if (ret != CMD_NEXT)
+            return ret;
     }
+    cpio.batch(ops);
 
     cpio.dump(incpio);
     return 0;
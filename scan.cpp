@@ -0,0 +1,86 @@
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define SCAN_NEON
+#endif
+
+#include "scan.hpp"
+
+using namespace std;
+
+magic_scanner::magic_scanner(initializer_list<string_view> magics) : magics(magics) {
+    for (auto magic : magics) {
+        auto c = static_cast<uint8_t>(magic[0]);
+        if (!first[c])
+            firsts.push_back(c);
+        first[c] = true;
+    }
+}
+
+int magic_scanner::match(const uint8_t *buf, size_t len, size_t off) const {
+    for (int i = 0; i < (int) magics.size(); ++i) {
+        auto &magic = magics[i];
+        if (len - off >= magic.size() && memcmp(buf + off, magic.data(), magic.size()) == 0)
+            return i;
+    }
+    return -1;
+}
+
+size_t magic_scanner::find(const void *data, size_t len, size_t from, int *idx) const {
+    auto buf = static_cast<const uint8_t *>(data);
+    size_t i = from;
+
+    // Bit n of mask is set if byte n of the block at i is the first byte of some magic
+    auto verify = [&](uint32_t mask) -> bool {
+        for (; mask; mask &= mask - 1) {
+            size_t off = i + __builtin_ctz(mask);
+            if (int m = match(buf, len, off); m >= 0) {
+                if (idx) *idx = m;
+                i = off;
+                return true;
+            }
+        }
+        return false;
+    };
+
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+        __m128i hit = _mm_setzero_si128();
+        for (uint8_t c : firsts)
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+        if (uint32_t mask = _mm_movemask_epi8(hit); mask && verify(mask))
+            return i;
+    }
+#elif defined(SCAN_NEON)
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(buf + i);
+        uint8x16_t hit = vdupq_n_u8(0);
+        for (uint8_t c : firsts)
+            hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(c)));
+        // Narrow to one nibble per byte, there is no movemask on NEON
+        uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        if (nibbles == 0)
+            continue;
+        uint32_t mask = 0;
+        for (int n = 0; n < 16; ++n)
+            mask |= ((nibbles >> (n * 4)) & 1) << n;
+        if (verify(mask))
+            return i;
+    }
+#endif
+
+    for (; i < len; ++i) {
+        if (!first[buf[i]])
+            continue;
+        if (int m = match(buf, len, i); m >= 0) {
+            if (idx) *idx = m;
+            return i;
+        }
+    }
+    return len;
+}
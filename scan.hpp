@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <initializer_list>
+#include <string_view>
+#include <vector>
+
+// Magic with its exact length, as some of them contain NUL bytes
+#define MAGIC(s) std::string_view(s, sizeof(s) - 1)
+
+// Finds the first occurrence of any of a set of magics in a single pass. Candidate
+// offsets are found with a vectorized filter on the first byte of every magic, then
+// verified. Magics are tried in the order given, the first one matching wins.
+class magic_scanner {
+public:
+    magic_scanner(std::initializer_list<std::string_view> magics);
+
+    // Offset of the first magic found in buf at or after from, or len if there is none.
+    // The index of the magic found is stored in idx.
+    size_t find(const void *buf, size_t len, size_t from = 0, int *idx = nullptr) const;
+
+private:
+    int match(const uint8_t *buf, size_t len, size_t off) const;
+
+    std::vector<std::string_view> magics;
+    // Distinct first bytes of all magics
+    std::vector<uint8_t> firsts;
+    bool first[256] = {};
+};